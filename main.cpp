@@ -5,7 +5,44 @@
 #include <fstream>
 #include <algorithm>
 #include <ctime>
+#include <unordered_set>
+#include <unordered_map>
+#include <future>
+#include <thread>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <sstream>
+#include <map>
+#include <tuple>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <cstdlib>
+#include <stdexcept>
+#include <cmath>
+#include <cctype>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+#include <coroutine>
+#endif
 #include "json.hpp" 
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <cstring>
+#endif
 
 using json = nlohmann::json;
 
@@ -13,239 +50,4008 @@ struct Book {
     std::string Title;
     std::string Author;
     std::string ISBN;
-    bool IsAvailable = true;
+    bool IsAvailable = true; // derived from open loans by LibraryManager, not persisted
+    std::string Added = "";  // ISO string; empty for books saved before it was recorded
 
     void MarkAsLoaned() { IsAvailable = false; }
     void MarkAsAvailable() { IsAvailable = true; }
 
     json to_json() const {
-        return json{{"Title", Title}, {"Author", Author}, {"ISBN", ISBN}, {"IsAvailable", IsAvailable}};
+        json j = {{"Title", Title}, {"Author", Author}, {"ISBN", ISBN}};
+        if (!Added.empty()) j["Added"] = Added;
+        return j;
+    }
+    static Book from_json(const json &j) {
+        Book b;
+        b.Title = j.value("Title", "");
+        b.Author = j.value("Author", "");
+        b.ISBN = j.value("ISBN", "");
+        b.Added = j.value("Added", "");
+        return b;
+    }
+};
+
+struct Reader {
+    int Id = 0;
+    std::string Name;
+    std::string Email;
+    std::string Registered = ""; // ISO string; empty for readers saved before it was recorded
+
+    json to_json() const {
+        json j = {{"Id", Id}, {"Name", Name}, {"Email", Email}};
+        if (!Registered.empty()) j["Registered"] = Registered;
+        return j;
+    }
+    static Reader from_json(const json &j) {
+        Reader r;
+        r.Id = j.value("Id", 0);
+        r.Name = j.value("Name", "");
+        r.Email = j.value("Email", "");
+        r.Registered = j.value("Registered", "");
+        return r;
+    }
+};
+
+struct Loan {
+    std::string BookISBN;
+    int ReaderId = 0;
+    std::string LoanDate; // ISO string
+    std::optional<std::string> ReturnDate;
+
+    json to_json() const {
+        json j = {{"BookISBN", BookISBN}, {"ReaderId", ReaderId}, {"LoanDate", LoanDate}};
+        if (ReturnDate) j["ReturnDate"] = *ReturnDate;
+        else j["ReturnDate"] = nullptr;
+        return j;
+    }
+    static Loan from_json(const json &j) {
+        Loan l;
+        l.BookISBN = j.value("BookISBN", "");
+        l.ReaderId = j.value("ReaderId", 0);
+        l.LoanDate = j.value("LoanDate", "");
+        if (!j["ReturnDate"].is_null()) l.ReturnDate = j.value("ReturnDate", "");
+        return l;
+    }
+};
+
+static std::string now_iso() {
+    std::time_t t = std::time(nullptr);
+    char buf[64];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&t));
+    return std::string(buf);
+}
+
+// ISO timestamp of "now minus N years"; ISO strings compare lexicographically
+static std::string iso_years_ago(int years) {
+    std::time_t t = std::time(nullptr);
+    std::tm tm = *std::gmtime(&t);
+    tm.tm_year -= years;
+    char buf[64];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    return std::string(buf);
+}
+
+// One entry of the change feed: every LibraryManager mutation emits one.
+struct ChangeEvent {
+    uint64_t Seq = 0;
+    std::string Op;   // AddBook, RemoveBook, AddReader, RemoveReader, IssueLoan, ReturnBook, RecordLoan, Purge, Repair,
+                      // ExportBooks, ImportBook, ImportLoans, Checkpoint,
+                      // Tx (Data.Ops: [{Op, Data}], applied as one unit)
+    std::string Time;
+    json Data;
+
+    json to_json() const {
+        return json{{"Seq", Seq}, {"Op", Op}, {"Time", Time}, {"Data", Data}};
+    }
+    static ChangeEvent from_json(const json &j) {
+        ChangeEvent e;
+        e.Seq = j.value("Seq", uint64_t(0));
+        e.Op = j.value("Op", "");
+        e.Time = j.value("Time", "");
+        if (j.contains("Data")) e.Data = j["Data"];
+        return e;
+    }
+};
+
+// Tails a change log written by LibraryManager::OpenChangeLog. Poll() returns
+// only the events appended since the previous call.
+class ChangeLogReader {
+public:
+    explicit ChangeLogReader(std::string path) : path(std::move(path)) {}
+
+    std::vector<ChangeEvent> Poll() {
+        std::vector<ChangeEvent> res;
+        std::ifstream f(path, std::ios::binary);
+        if (!f) return res;
+        f.seekg(offset);
+        std::string line;
+        while (std::getline(f, line)) {
+            if (f.eof()) break; // partial last line, the writer is not done with it
+            offset += line.size() + 1;
+            if (line.empty()) continue;
+            try { res.push_back(ChangeEvent::from_json(json::parse(line))); } catch (...) {}
+        }
+        return res;
+    }
+
+private:
+    std::string path;
+    std::streamoff offset = 0;
+};
+
+// Events after the last Checkpoint in a change log, i.e. what the saved files do not contain yet.
+static std::vector<ChangeEvent> EventsSinceCheckpoint(const std::string &path) {
+    auto events = ChangeLogReader(path).Poll();
+    size_t from = 0;
+    for (size_t i = 0; i < events.size(); ++i) if (events[i].Op == "Checkpoint") from = i + 1;
+    return std::vector<ChangeEvent>(events.begin() + from, events.end());
+}
+
+struct PoolOptions {
+    size_t Threads = 0;      // 0: one per hardware thread
+    bool PinToCores = false; // bind worker i to core i % cores (Linux)
+};
+
+struct PoolStats {
+    size_t QueueDepth = 0;             // tasks waiting, all workers
+    std::vector<size_t> WorkerDepth;   // tasks waiting, per worker
+    uint64_t Executed = 0;
+    uint64_t Steals = 0;
+};
+
+// Work-stealing task scheduler shared by the parallel features (integrity
+// check, federated search, AsyncLibrary). Each worker owns a deque: tasks
+// posted from a worker go to the back of its own deque and it pops from the
+// back (newest first, cache-warm); idle workers steal from the front of
+// other deques. Tasks posted from outside are spread round-robin.
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(PoolOptions opt) {
+        size_t n = opt.Threads ? opt.Threads : std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < n; ++i) workers.push_back(std::make_unique<Worker>());
+        for (size_t i = 0; i < n; ++i) {
+            threads.emplace_back([this, i]{ Loop(i); });
+#ifdef __linux__
+            if (opt.PinToCores) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(i % std::max(1u, std::thread::hardware_concurrency()), &set);
+                pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+            }
+#endif
+        }
+    }
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+    ~WorkStealingPool() {
+        { std::lock_guard<std::mutex> g(sleepMu); stopping = true; }
+        wake.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+    size_t Size() const { return workers.size(); }
+
+    void Post(std::function<void()> fn) {
+        size_t w = currentPool == this ? currentWorker : next++ % workers.size();
+        // counted before it is visible: a thief could otherwise run it and
+        // decrement pending below zero
+        {
+            std::lock_guard<std::mutex> g(sleepMu);
+            ++pending;
+        }
+        {
+            std::lock_guard<std::mutex> g(workers[w]->mu);
+            workers[w]->q.push_back(std::move(fn));
+        }
+        wake.notify_one();
+    }
+
+    template <class F>
+    auto Submit(F f) -> std::future<decltype(f())> {
+        auto task = std::make_shared<std::packaged_task<decltype(f())()>>(std::move(f));
+        auto fut = task->get_future();
+        Post([task]{ (*task)(); });
+        return fut;
+    }
+
+    // Waits for a future; a worker thread keeps running other tasks meanwhile
+    // instead of blocking (a blocked worker could deadlock the pool).
+    template <class T>
+    bool WaitUntil(std::future<T> &f, std::chrono::steady_clock::time_point deadline) {
+        while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (std::chrono::steady_clock::now() >= deadline) return false;
+            if (currentPool != this) { f.wait_until(deadline); continue; }
+            if (!TryRun(currentWorker)) std::this_thread::yield();
+        }
+        return true;
+    }
+    template <class T>
+    T Get(std::future<T> &f) {
+        WaitUntil(f, std::chrono::steady_clock::time_point::max());
+        return f.get();
+    }
+
+    PoolStats Stats() const {
+        PoolStats s;
+        for (auto &w : workers) {
+            std::lock_guard<std::mutex> g(w->mu);
+            s.WorkerDepth.push_back(w->q.size());
+            s.QueueDepth += w->q.size();
+            s.Executed += w->executed;
+            s.Steals += w->steals;
+        }
+        return s;
+    }
+
+private:
+    struct Worker {
+        std::deque<std::function<void()>> q;
+        mutable std::mutex mu;
+        std::atomic<uint64_t> executed{0}, steals{0};
+    };
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next{0};
+    std::mutex sleepMu;
+    std::condition_variable wake;
+    size_t pending = 0; // queued tasks, guarded by sleepMu
+    bool stopping = false;
+
+    static inline thread_local WorkStealingPool *currentPool = nullptr;
+    static inline thread_local size_t currentWorker = 0;
+
+    bool TryRun(size_t self) {
+        std::function<void()> fn;
+        bool stolen = false;
+        {
+            std::lock_guard<std::mutex> g(workers[self]->mu);
+            if (!workers[self]->q.empty()) { fn = std::move(workers[self]->q.back()); workers[self]->q.pop_back(); }
+        }
+        for (size_t k = 1; !fn && k < workers.size(); ++k) {
+            Worker &v = *workers[(self + k) % workers.size()];
+            std::lock_guard<std::mutex> g(v.mu);
+            if (!v.q.empty()) { fn = std::move(v.q.front()); v.q.pop_front(); stolen = true; }
+        }
+        if (!fn) return false;
+        { std::lock_guard<std::mutex> g(sleepMu); --pending; }
+        if (stolen) ++workers[self]->steals;
+        fn();
+        ++workers[self]->executed;
+        return true;
+    }
+
+    void Loop(size_t i) {
+        currentPool = this;
+        currentWorker = i;
+        while (true) {
+            if (TryRun(i)) continue;
+            std::unique_lock<std::mutex> g(sleepMu);
+            wake.wait(g, [&]{ return stopping || pending > 0; });
+            if (stopping && pending == 0) return;
+        }
+    }
+};
+
+// Settings for DefaultPool(); only read when the pool is first used.
+static PoolOptions &DefaultPoolOptions() {
+    static PoolOptions opt;
+    return opt;
+}
+
+static WorkStealingPool &DefaultPool() {
+    static WorkStealingPool pool(DefaultPoolOptions());
+    return pool;
+}
+
+// Cooperative stop signal for long scans (search, reports, exports). Copies
+// share one state, so whoever holds a copy can Cancel() from any thread; a
+// deadline counts as a cancellation once it passes. Scans poll it every
+// CheckEvery rows and return what they have so far. A default-constructed
+// token never cancels and costs nothing.
+class CancelToken {
+public:
+    static constexpr size_t CheckEvery = 256;
+
+    CancelToken() = default;
+    static CancelToken Manual() {
+        CancelToken t;
+        t.state = std::make_shared<State>();
+        return t;
+    }
+    static CancelToken After(std::chrono::milliseconds timeout) {
+        CancelToken t = Manual();
+        t.state->hasDeadline = true;
+        t.state->deadline = std::chrono::steady_clock::now() + timeout;
+        return t;
+    }
+
+    void Cancel() const { if (state) state->cancelled = true; }
+    bool Cancelled() const {
+        if (!state) return false;
+        if (state->cancelled) return true;
+        if (state->hasDeadline && std::chrono::steady_clock::now() >= state->deadline) state->cancelled = true;
+        return state->cancelled;
+    }
+    // For loops: checks only on every CheckEvery-th row.
+    bool Cancelled(size_t row) const { return state && row % CheckEvery == 0 && Cancelled(); }
+
+private:
+    struct State {
+        std::atomic<bool> cancelled{false};
+        bool hasDeadline = false;
+        std::chrono::steady_clock::time_point deadline;
+    };
+    std::shared_ptr<State> state;
+};
+
+static inline int Popcount64(uint64_t x) {
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    return int((((x + (x >> 4)) & 0x0f0f0f0f0f0f0f0full) * 0x0101010101010101ull) >> 56);
+#endif
+}
+
+// popcount(a & b) over `words` 64-bit words; with AVX2, 256 bits per step
+// using the nibble lookup (vpshufb) popcount.
+static uint64_t AndPopcount(const uint64_t *a, const uint64_t *b, size_t words) {
+    uint64_t n = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t vec = words & ~size_t(3); i < vec; i += 4) {
+        __m256i v = _mm256_and_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)),
+                                     _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+        __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, _mm256_and_si256(v, low)),
+                                      _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(cnt, _mm256_setzero_si256()));
+    }
+    n = uint64_t(_mm256_extract_epi64(acc, 0)) + uint64_t(_mm256_extract_epi64(acc, 1)) +
+        uint64_t(_mm256_extract_epi64(acc, 2)) + uint64_t(_mm256_extract_epi64(acc, 3));
+#endif
+    for (; i < words; ++i) n += Popcount64(a[i] & b[i]);
+    return n;
+}
+
+// Compressed set of 32-bit ids in the Roaring layout: ids are grouped by
+// their high 16 bits, and a group is a sorted array of the low halves while
+// it has at most 4096 of them, or a 65536-bit bitset once denser. Counting
+// an intersection never lists ids: bitset pairs are AND + popcount, arrays
+// probe the other side.
+class Bitmap {
+public:
+    void Add(uint32_t x) {
+        Container &c = Get(uint16_t(x >> 16));
+        uint16_t lo = uint16_t(x);
+        if (c.Dense()) {
+            uint64_t &w = c.Bits[lo >> 6], bit = uint64_t(1) << (lo & 63);
+            if (!(w & bit)) { w |= bit; ++c.Card; }
+            return;
+        }
+        auto it = std::lower_bound(c.Array.begin(), c.Array.end(), lo);
+        if (it != c.Array.end() && *it == lo) return;
+        c.Array.insert(it, lo);
+        ++c.Card;
+        if (c.Card > ArrayMax) ToBits(c);
+    }
+    void Remove(uint32_t x) {
+        size_t k = Find(uint16_t(x >> 16));
+        if (k == keys.size()) return;
+        Container &c = conts[k];
+        uint16_t lo = uint16_t(x);
+        if (c.Dense()) {
+            uint64_t &w = c.Bits[lo >> 6], bit = uint64_t(1) << (lo & 63);
+            if (w & bit) { w &= ~bit; --c.Card; }
+            return;
+        }
+        auto it = std::lower_bound(c.Array.begin(), c.Array.end(), lo);
+        if (it != c.Array.end() && *it == lo) { c.Array.erase(it); --c.Card; }
+    }
+    bool Contains(uint32_t x) const {
+        size_t k = Find(uint16_t(x >> 16));
+        return k < keys.size() && Has(conts[k], uint16_t(x));
+    }
+    uint64_t Cardinality() const {
+        uint64_t n = 0;
+        for (auto &c : conts) n += c.Card;
+        return n;
+    }
+
+    // union in place
+    void Or(const Bitmap &o) {
+        for (size_t j = 0; j < o.keys.size(); ++j) Merge(Get(o.keys[j]), o.conts[j]);
+    }
+
+    static uint64_t AndCardinality(const Bitmap &a, const Bitmap &b) {
+        uint64_t n = 0;
+        size_t i = 0, j = 0;
+        while (i < a.keys.size() && j < b.keys.size()) {
+            if (a.keys[i] < b.keys[j]) ++i;
+            else if (a.keys[i] > b.keys[j]) ++j;
+            else n += AndCard(a.conts[i++], b.conts[j++]);
+        }
+        return n;
+    }
+
+private:
+    static constexpr uint32_t ArrayMax = 4096;
+    struct Container {
+        std::vector<uint16_t> Array; // sorted low halves, while Bits is empty
+        std::vector<uint64_t> Bits;  // 1024 words once dense
+        uint32_t Card = 0;
+        bool Dense() const { return !Bits.empty(); }
+    };
+    std::vector<uint16_t> keys; // sorted high halves
+    std::vector<Container> conts;
+
+    size_t Find(uint16_t key) const {
+        size_t k = size_t(std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+        return k < keys.size() && keys[k] == key ? k : keys.size();
+    }
+    Container &Get(uint16_t key) {
+        auto it = std::lower_bound(keys.begin(), keys.end(), key);
+        size_t k = size_t(it - keys.begin());
+        if (it == keys.end() || *it != key) {
+            keys.insert(it, key);
+            conts.insert(conts.begin() + k, Container());
+        }
+        return conts[k];
+    }
+    static bool Has(const Container &c, uint16_t lo) {
+        if (c.Dense()) return c.Bits[lo >> 6] >> (lo & 63) & 1;
+        return std::binary_search(c.Array.begin(), c.Array.end(), lo);
+    }
+    static void ToBits(Container &c) {
+        c.Bits.assign(1024, 0);
+        for (uint16_t lo : c.Array) c.Bits[lo >> 6] |= uint64_t(1) << (lo & 63);
+        c.Array.clear();
+        c.Array.shrink_to_fit();
+    }
+    static void Merge(Container &a, const Container &b) {
+        if (b.Dense() && !a.Dense()) ToBits(a);
+        if (a.Dense()) {
+            if (b.Dense()) for (size_t w = 0; w < 1024; ++w) a.Bits[w] |= b.Bits[w];
+            else for (uint16_t lo : b.Array) a.Bits[lo >> 6] |= uint64_t(1) << (lo & 63);
+            a.Card = 0;
+            for (uint64_t w : a.Bits) a.Card += Popcount64(w);
+            return;
+        }
+        std::vector<uint16_t> u;
+        u.reserve(a.Array.size() + b.Array.size());
+        std::set_union(a.Array.begin(), a.Array.end(), b.Array.begin(), b.Array.end(), std::back_inserter(u));
+        a.Array.swap(u);
+        a.Card = uint32_t(a.Array.size());
+        if (a.Card > ArrayMax) ToBits(a);
+    }
+    static uint64_t AndCard(const Container &a, const Container &b) {
+        if (a.Dense() && b.Dense()) return AndPopcount(a.Bits.data(), b.Bits.data(), 1024);
+        if (a.Dense() || b.Dense()) {
+            const Container &arr = a.Dense() ? b : a, &bits = a.Dense() ? a : b;
+            uint64_t n = 0;
+            for (uint16_t lo : arr.Array) n += bits.Bits[lo >> 6] >> (lo & 63) & 1;
+            return n;
+        }
+        // probe the larger array from the smaller one
+        const auto &x = a.Array.size() <= b.Array.size() ? a.Array : b.Array;
+        const auto &y = a.Array.size() <= b.Array.size() ? b.Array : a.Array;
+        uint64_t n = 0;
+        auto from = y.begin();
+        for (uint16_t lo : x) {
+            from = std::lower_bound(from, y.end(), lo);
+            if (from == y.end()) break;
+            n += *from == lo;
+        }
+        return n;
+    }
+};
+
+// Next code point of UTF-8 text at i (advancing i); malformed input gives U+FFFD.
+static uint32_t DecodeUtf8(const std::string &s, size_t &i) {
+    unsigned char c = s[i++];
+    if (c < 0x80) return c;
+    if (c < 0xC0) return 0xFFFD;
+    int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : 1;
+    uint32_t cp = c & (0x3F >> extra);
+    for (; extra > 0 && i < s.size() && (s[i] & 0xC0) == 0x80; --extra) cp = (cp << 6) | (s[i++] & 0x3F);
+    return extra ? 0xFFFD : cp;
+}
+
+static void AppendUtf8(std::string &out, uint32_t cp) {
+    if (cp < 0x80) out += char(cp);
+    else if (cp < 0x800) out += char(0xC0 | cp >> 6), out += char(0x80 | (cp & 0x3F));
+    else if (cp < 0x10000) out += char(0xE0 | cp >> 12), out += char(0x80 | (cp >> 6 & 0x3F)), out += char(0x80 | (cp & 0x3F));
+    else out += char(0xF0 | cp >> 18), out += char(0x80 | (cp >> 12 & 0x3F)), out += char(0x80 | (cp >> 6 & 0x3F)), out += char(0x80 | (cp & 0x3F));
+}
+
+// Lower case for the scripts in our catalogue: ASCII, Latin-1, Russian and
+// Kazakh Cyrillic.
+static uint32_t FoldCodepoint(uint32_t cp) {
+    if (cp >= 'A' && cp <= 'Z') return cp + 0x20;
+    if (cp >= 0xC0 && cp <= 0xDE && cp != 0xD7) return cp + 0x20;
+    if (cp >= 0x410 && cp <= 0x42F) return cp + 0x20; // А-Я
+    if (cp >= 0x400 && cp <= 0x40F) return cp + 0x50; // Ѐ-Џ, including Ё and І
+    // extended Cyrillic pairs (upper even): Ғ Қ Ң Ү Ұ Һ Ә Ө ...
+    if ((cp >= 0x460 && cp <= 0x481) || (cp >= 0x48A && cp <= 0x4BF) || (cp >= 0x4D0 && cp <= 0x4FF)) return cp | 1;
+    if (cp >= 0x4C1 && cp <= 0x4CE && (cp & 1)) return cp + 1;
+    return cp;
+}
+
+static std::string FoldCase(const std::string &s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size();) {
+        size_t start = i;
+        uint32_t cp = DecodeUtf8(s, i);
+        if (cp == 0xFFFD) out.append(s, start, i - start);
+        else AppendUtf8(out, FoldCodepoint(cp));
+    }
+    return out;
+}
+
+// Search key of a case-folded word, the same for its Cyrillic and Latin
+// spellings: Cyrillic is romanized ("абай" and "abai" -> "abai"), then the
+// usual variation of romanized names is flattened: y is i ("Tolstoy",
+// "Толстой" -> "tolstoi") and doubled letters count once.
+static std::string Romanize(const std::string &folded) {
+    static const std::unordered_map<uint32_t, const char *> table = {
+        {0x430, "a"}, {0x431, "b"}, {0x432, "v"}, {0x433, "g"}, {0x434, "d"}, {0x435, "e"}, {0x451, "e"},
+        {0x436, "zh"}, {0x437, "z"}, {0x438, "i"}, {0x439, "i"}, {0x43A, "k"}, {0x43B, "l"}, {0x43C, "m"},
+        {0x43D, "n"}, {0x43E, "o"}, {0x43F, "p"}, {0x440, "r"}, {0x441, "s"}, {0x442, "t"}, {0x443, "u"},
+        {0x444, "f"}, {0x445, "kh"}, {0x446, "ts"}, {0x447, "ch"}, {0x448, "sh"}, {0x449, "shch"},
+        {0x44A, ""}, {0x44B, "y"}, {0x44C, ""}, {0x44D, "e"}, {0x44E, "yu"}, {0x44F, "ya"},
+        // Kazakh
+        {0x4D9, "a"}, {0x493, "g"}, {0x49B, "k"}, {0x4A3, "n"}, {0x4E9, "o"}, {0x4B1, "u"}, {0x4AF, "u"},
+        {0x4BB, "h"}, {0x456, "i"},
+    };
+    std::string latin;
+    for (size_t i = 0; i < folded.size();) {
+        size_t start = i;
+        uint32_t cp = DecodeUtf8(folded, i);
+        auto it = table.find(cp);
+        if (it != table.end()) latin += it->second;
+        else latin.append(folded, start, i - start);
+    }
+    std::string key;
+    for (char c : latin) {
+        if (c == 'y') c = 'i';
+        if (!key.empty() && key.back() == c && std::isalpha((unsigned char)c)) continue;
+        key += c;
+    }
+    return key;
+}
+
+// Light suffix-stripping stemmer for case-folded Russian and Kazakh words,
+// so inflections share one index term ("книга", "книги", "книгой" -> "книг").
+// Kazakh words (a Kazakh-only letter, or a plural suffix under the case and
+// possessive ones) lose their case, possessive and plural suffixes, and a
+// stem-final consonant voiced by a suffix is restored ("кітабы" -> "кітап").
+// Other Cyrillic words lose one Russian noun/adjective ending after the
+// first vowel. Other scripts are returned unchanged. Stems keep at least
+// two letters.
+static std::string StemWord(const std::string &folded) {
+    std::u32string w;
+    for (size_t i = 0; i < folded.size();) w += char32_t(DecodeUtf8(folded, i));
+    bool cyrillic = false, kazakh = false;
+    for (char32_t c : w) {
+        cyrillic = cyrillic || (c >= 0x400 && c <= 0x4FF);
+        kazakh = kazakh || std::u32string(U"әғқңөұүһі").find(c) != std::u32string::npos;
+    }
+    if (!cyrillic) return folded;
+
+    // strips the longest of `endings` found at the end of w[from..]
+    auto strip = [&](const std::vector<std::u32string> &endings, size_t from) {
+        size_t best = 0;
+        for (auto &e : endings) {
+            if (e.size() > best && w.size() >= from + e.size() && w.size() - e.size() >= 2 &&
+                w.compare(w.size() - e.size(), e.size(), e) == 0)
+                best = e.size();
+        }
+        w.resize(w.size() - best);
+        return best > 0;
+    };
+    static const std::vector<std::u32string> cases = {
+        U"ның", U"нің", U"дың", U"дің", U"тың", U"тің", U"ға", U"ге", U"қа", U"ке", U"на", U"не",
+        U"ны", U"ні", U"ды", U"ді", U"ты", U"ті", U"да", U"де", U"та", U"те", U"нда", U"нде",
+        U"дан", U"ден", U"тан", U"тен", U"нан", U"нен", U"ндан", U"нден", U"мен", U"бен", U"пен"};
+    static const std::vector<std::u32string> possessive = {
+        U"ым", U"ім", U"ың", U"ің", U"ы", U"і", U"сы", U"сі", U"ымыз", U"іміз", U"мыз", U"міз"};
+    static const std::vector<std::u32string> plural = {U"лар", U"лер", U"дар", U"дер", U"тар", U"тер"};
+    static const std::vector<std::u32string> russian = {
+        // adjectival
+        U"ими", U"ыми", U"его", U"ого", U"ему", U"ому", U"ее", U"ие", U"ые", U"ое", U"ей", U"ий", U"ый",
+        U"ой", U"ем", U"им", U"ым", U"ом", U"их", U"ых", U"ую", U"юю", U"ая", U"яя", U"ою", U"ею",
+        // nominal
+        U"иями", U"ями", U"ами", U"ией", U"иям", U"ием", U"иях", U"ев", U"ов", U"ье", U"еи", U"ии",
+        U"ям", U"ам", U"ах", U"ях", U"ию", U"ью", U"ия", U"ья",
+        U"а", U"е", U"и", U"о", U"у", U"ы", U"ь", U"ю", U"я"};
+
+    // A plural ending counts only if it agrees with the stem the Kazakh way:
+    // лар after a vowel, р or й, дар after з ж л м н ң, тар otherwise, and а/е
+    // by the stem's last vowel. That leaves Russian поттер, ветер, радар and
+    // мастер alone.
+    auto pluralFits = [](const std::u32string &stem, char32_t head, char32_t vowel) {
+        static const std::u32string vowels = U"аәеёиоөуұүыіэюя", back = U"аоұыя", front = U"әеөүіэ";
+        char32_t last = stem.back();
+        char32_t want = vowels.find(last) != std::u32string::npos || last == U'р' || last == U'й' ? U'л'
+                      : std::u32string(U"зжлмнң").find(last) != std::u32string::npos ? U'д' : U'т';
+        if (head != want) return false;
+        for (size_t i = stem.size(); i-- > 0;) {
+            if (back.find(stem[i]) != std::u32string::npos) return vowel == U'а';
+            if (front.find(stem[i]) != std::u32string::npos) return vowel == U'е';
+        }
+        return true;
+    };
+
+    std::u32string orig = w;
+    bool suffixed = strip(cases, 0);
+    suffixed = strip(possessive, 0) || suffixed;
+    std::u32string unstripped = w;
+    bool plur = strip(plural, 0);
+    if (plur && !pluralFits(w, unstripped[w.size()], unstripped[w.size() + 1])) { w = unstripped; plur = false; }
+    if (kazakh || plur) {
+        static const std::u32string voiced = U"бғг", voiceless = U"пқк";
+        size_t v = voiced.find(w.back());
+        if ((suffixed || plur) && v != std::u32string::npos) w.back() = voiceless[v];
+    } else {
+        w = orig;
+        size_t rv = 0; // endings may only come after the first vowel
+        while (rv < w.size() && std::u32string(U"аеиоуыэюяё").find(w[rv]) == std::u32string::npos) ++rv;
+        if (rv < w.size()) strip(russian, rv + 1);
+    }
+    std::string out;
+    for (char32_t c : w) AppendUtf8(out, uint32_t(c));
+    return out;
+}
+
+// Sound-alike key of a romanized name word, in the spirit of Metaphone but
+// tuned to romanized Russian/Kazakh names: vowels after the first letter are
+// dropped, consonants that spellings swap are merged (kh/h/k/q/g -> K,
+// zh/j/dzh -> J, v/f/w -> F, b/p -> P, d/t -> T, z/s -> S, ch/tch -> C) and
+// repeats collapse. "Chekhov", "Tchekov" -> CKF; "Zhumabayev", "Jumabaev" -> JMPF.
+// A leading vowel is kept as A.
+static std::string PhoneticKey(const std::string &w) {
+    auto vowel = [](char c){ return c == 'a' || c == 'e' || c == 'i' || c == 'o' || c == 'u' || c == 'y'; };
+    std::string key;
+    auto put = [&](char code){ if (key.empty() || key.back() != code) key += code; };
+    for (size_t i = 0; i < w.size();) {
+        auto at = [&](const char *d){ return w.compare(i, std::char_traits<char>::length(d), d) == 0; };
+        char c = w[i];
+        if (at("shch")) { put('S'); i += 4; continue; }
+        if (at("tch") || at("tsch")) { put('C'); i += at("tch") ? 3 : 4; continue; }
+        if (at("dzh")) { put('J'); i += 3; continue; }
+        if (at("sh") || at("sch")) { put('S'); i += at("sch") ? 3 : 2; continue; }
+        if (at("zh")) { put('J'); i += 2; continue; }
+        if (at("kh") || at("ck")) { put('K'); i += 2; continue; }
+        if (at("ch")) { put('C'); i += 2; continue; }
+        if (at("ph")) { put('F'); i += 2; continue; }
+        if (at("th")) { put('T'); i += 2; continue; }
+        ++i;
+        if (vowel(c)) {
+            if (key.empty()) key += 'A';
+            continue;
+        }
+        switch (c) {
+        case 'b': case 'p': put('P'); break;
+        case 'v': case 'f': put('F'); break;
+        case 'w': if (i == 1 || !vowel(w[i - 2])) put('F'); break; // "aw" is a vowel
+        case 'g': case 'k': case 'q': case 'h': put('K'); break;
+        case 'c': put(i < w.size() && (w[i] == 'e' || w[i] == 'i') ? 'S' : 'K'); break;
+        case 'x': put('K'); put('S'); break;
+        case 'j': put('J'); break;
+        case 'd': case 't': put('T'); break;
+        case 'z': case 's': put('S'); break;
+        default: if (std::isalnum((unsigned char)c)) put(char(std::toupper((unsigned char)c))); break;
+        }
+    }
+    return key;
+}
+
+// Ranked full-text index over Title and Author, keyed by position in Books.
+// Each field has its own postings (term -> docs in ascending order with the
+// term's frequency); a document's score is the boosted sum of per-field BM25
+// scores of the query terms. TopK uses MaxScore: lists are ordered by their
+// score upper bound, and once the k-th best score exceeds the combined bound
+// of the weakest lists, those lists are only probed for documents found via
+// the others, so most candidates are never scored. Terms are indexed by their
+// search key (case-folded and romanized), so "Abai" finds "Абай" and back
+// with no extra work per query; title words are stemmed first, on both sides,
+// so one lookup matches every inflection. A per-document static
+// score (popularity) is added to the text score of every match; its maximum
+// joins the bounds, so pruning stays exact. For facet counts every posting
+// list also has a Bitmap of its documents, and every author one of theirs.
+// Alphabetical browsing uses ordered trees of collation keys per field.
+class TextIndex {
+public:
+    enum Field { Title, Author, FieldCount };
+    static constexpr double K1 = 1.2, B = 0.75;
+
+    struct Hit {
+        uint32_t Doc;
+        double Score;
+    };
+
+    size_t Docs() const { return docLen[Title].size(); }
+
+    void Clear() { *this = TextIndex(); }
+
+    // Appends the next document; docs must be added in Books order.
+    void Add(const Book &b) {
+        uint32_t doc = uint32_t(Docs());
+        staticScore.push_back(0);
+        std::string author = FoldCase(b.Author);
+        auto aid = authorIds.emplace(author, uint32_t(authorNames.size()));
+        if (aid.second) {
+            authorNames.push_back(b.Author);
+            authorDocs.emplace_back();
+        }
+        authorDocs[aid.first->second].Add(doc);
+        authorOrderStale = true;
+        // the ISBN makes keys unique and orders equal titles
+        sorted[Title].emplace(SortKey(b.Title) + std::string(3, '\0') + b.ISBN, doc);
+        sorted[Author].emplace(SortKey(b.Author) + std::string(3, '\0') + b.ISBN, doc);
+        const std::string *text[FieldCount] = {&b.Title, &b.Author};
+        for (int f = 0; f < FieldCount; ++f) {
+            auto tokens = Terms(*text[f], Field(f));
+            docLen[f].push_back(uint32_t(tokens.size()));
+            totalLen[f] += tokens.size();
+            if (tokens.empty()) continue;
+            minLen[f] = std::min(minLen[f], uint32_t(tokens.size()));
+            if (f == Author) {
+                std::vector<std::string> keys;
+                for (auto &t : tokens) keys.push_back(PhoneticKey(t));
+                std::sort(keys.begin(), keys.end());
+                keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+                for (auto &k : keys) sounds[k].push_back(doc);
+            }
+            std::sort(tokens.begin(), tokens.end());
+            for (size_t i = 0; i < tokens.size();) {
+                size_t j = i;
+                while (j < tokens.size() && tokens[j] == tokens[i]) ++j;
+                auto &pl = postings[f][tokens[i]];
+                pl.Docs.push_back({doc, uint32_t(j - i)});
+                pl.Set.Add(doc);
+                pl.MaxTf = std::max(pl.MaxTf, uint32_t(j - i));
+                i = j;
+            }
+        }
+    }
+
+    void SetStatic(uint32_t doc, double score) {
+        staticScore[doc] = float(score);
+        maxStatic = std::max(maxStatic, double(staticScore[doc]));
+    }
+
+    // Best k documents for the query, highest score first (ties: lower doc).
+    std::vector<Hit> TopK(const std::string &query, size_t k, const CancelToken &cancel = CancelToken()) const {
+        std::vector<Hit> res;
+        if (!k || !Docs()) return res;
+        std::vector<Cursor> cur;
+        for (int f = 0; f < FieldCount; ++f) {
+            auto terms = Terms(query, Field(f));
+            std::sort(terms.begin(), terms.end());
+            terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+            for (auto &t : terms) {
+                auto it = postings[f].find(t);
+                if (it == postings[f].end()) continue;
+                Cursor c;
+                c.List = &it->second.Docs;
+                c.Field = f;
+                double df = double(c.List->size()), n = double(Docs());
+                c.Weight = FieldBoost(f) * std::log(1 + (n - df + 0.5) / (df + 0.5)) * (K1 + 1);
+                c.AvgLen = double(totalLen[f]) / n;
+                double maxTf = it->second.MaxTf;
+                c.Bound = c.Weight * maxTf / (maxTf + Norm(minLen[f], c.AvgLen));
+                cur.push_back(c);
+            }
+        }
+        if (cur.empty()) return res;
+        std::sort(cur.begin(), cur.end(), [](const Cursor &a, const Cursor &b){ return a.Bound < b.Bound; });
+        std::vector<double> prefix(cur.size());
+        for (size_t i = 0; i < cur.size(); ++i) prefix[i] = cur[i].Bound + (i ? prefix[i - 1] : 0);
+
+        // min-heap on (score, -doc): the top is the weakest of the current best k
+        auto worse = [](const Hit &a, const Hit &b){ return a.Score > b.Score || (a.Score == b.Score && a.Doc < b.Doc); };
+        std::vector<Hit> heap;
+        double threshold = 0;
+        size_t essential = 0; // lists below this index cannot lift a document into the top k alone
+        for (size_t step = 0;; ++step) {
+            if (cancel.Cancelled(step)) break;
+            uint32_t doc = UINT32_MAX;
+            for (size_t i = essential; i < cur.size(); ++i)
+                if (cur[i].Pos < cur[i].List->size()) doc = std::min(doc, (*cur[i].List)[cur[i].Pos].Doc);
+            if (doc == UINT32_MAX) break;
+            double score = staticScore[doc];
+            for (size_t i = essential; i < cur.size(); ++i) {
+                auto &c = cur[i];
+                if (c.Pos < c.List->size() && (*c.List)[c.Pos].Doc == doc) score += Score(c, (*c.List)[c.Pos++]);
+            }
+            for (size_t i = essential; i-- > 0;) {
+                if (heap.size() == k && score + prefix[i] <= threshold) break;
+                auto &c = cur[i];
+                c.Pos = size_t(std::lower_bound(c.List->begin() + c.Pos, c.List->end(), doc,
+                                                [](const Posting &p, uint32_t d){ return p.Doc < d; }) - c.List->begin());
+                if (c.Pos < c.List->size() && (*c.List)[c.Pos].Doc == doc) score += Score(c, (*c.List)[c.Pos]);
+            }
+            if (heap.size() < k) {
+                heap.push_back({doc, score});
+                std::push_heap(heap.begin(), heap.end(), worse);
+            } else if (score > threshold) {
+                std::pop_heap(heap.begin(), heap.end(), worse);
+                heap.back() = {doc, score};
+                std::push_heap(heap.begin(), heap.end(), worse);
+            } else {
+                continue;
+            }
+            if (heap.size() == k) {
+                threshold = heap.front().Score;
+                while (essential < cur.size() && prefix[essential] + maxStatic <= threshold) ++essential;
+            }
+        }
+        std::sort(heap.begin(), heap.end(), [](const Hit &a, const Hit &b){ return a.Score > b.Score || (a.Score == b.Score && a.Doc < b.Doc); });
+        return heap;
+    }
+
+    // Alphabetical range scan over a field: up to `limit` documents, starting
+    // after `cursor` (a key returned by an earlier call) or else at the first
+    // entry >= `from`, and stopping before `to` if given. `next` is set to
+    // the cursor for the following page, or cleared at the end.
+    std::vector<uint32_t> Ordered(Field f, const std::string &from, const std::string &to, const std::string &cursor,
+                                  size_t limit, std::string &next) const {
+        std::vector<uint32_t> res;
+        auto it = cursor.empty() ? sorted[f].lower_bound(SortKey(from)) : sorted[f].upper_bound(cursor);
+        std::string end = to.empty() ? std::string() : SortKey(to);
+        auto inRange = [&](decltype(it) i){ return i != sorted[f].end() && (end.empty() || i->first < end); };
+        for (; inRange(it) && res.size() < limit; ++it) {
+            res.push_back(it->second);
+            next = it->first;
+        }
+        if (!inRange(it)) next.clear();
+        return res;
+    }
+
+    // Sort key for alphabetical listings (Kazakh/Russian collation): digits,
+    // then Latin, then Cyrillic in Kazakh alphabet order (Russian order is
+    // the same minus the Kazakh letters; ё right after е). Case and
+    // punctuation are ignored and a word break sorts before any letter, so
+    // "Абай" < "Абай жолы" < "Абайдың". Each letter is a 3-byte big-endian
+    // weight, so keys compare as plain byte strings.
+    static std::string SortKey(const std::string &s) {
+        static const std::u32string cyrillic = U"аәбвгғдеёжзийкқлмнңоөпрстуұүфхһцчшщъыіьэюя";
+        std::string key;
+        auto put = [&](uint32_t w){ key += char(w >> 16), key += char(w >> 8 & 0xFF), key += char(w & 0xFF); };
+        for (auto &word : Tokenize(s)) {
+            if (!key.empty()) put(1);
+            for (size_t i = 0; i < word.size();) {
+                uint32_t cp = DecodeUtf8(word, i);
+                size_t c = cyrillic.find(char32_t(cp));
+                if (cp < 0x80) put(cp < 'a' ? 0x100 + cp : 0x200 + cp); // digits, then letters
+                else if (c != std::u32string::npos) put(0x1000 + uint32_t(c));
+                else put(0x2000 + cp); // other scripts by code point, after ours
+            }
+        }
+        return key;
+    }
+
+    // Documents matching any query term in any field (the ranked result set).
+    Bitmap Matching(const std::string &query) const {
+        Bitmap res;
+        for (int f = 0; f < FieldCount; ++f) {
+            for (auto &t : Terms(query, Field(f))) {
+                auto it = postings[f].find(t);
+                if (it != postings[f].end()) res.Or(it->second.Set);
+            }
+        }
+        return res;
+    }
+
+    // The n authors with most documents in `docs` (all documents if null),
+    // by count. Authors are visited largest first and the scan stops once an
+    // author's whole list is smaller than the n-th count found.
+    std::vector<std::pair<std::string, uint64_t>> TopAuthors(const Bitmap *docs, size_t n) const {
+        if (authorOrderStale) {
+            authorOrder.resize(authorDocs.size());
+            for (uint32_t i = 0; i < authorOrder.size(); ++i) authorOrder[i] = i;
+            std::vector<uint64_t> card(authorDocs.size());
+            for (size_t i = 0; i < card.size(); ++i) card[i] = authorDocs[i].Cardinality();
+            std::stable_sort(authorOrder.begin(), authorOrder.end(), [&](uint32_t a, uint32_t b){ return card[a] > card[b]; });
+            authorOrderStale = false;
+        }
+        std::vector<std::pair<std::string, uint64_t>> top;
+        auto more = [](const std::pair<std::string, uint64_t> &a, const std::pair<std::string, uint64_t> &b){ return a.second > b.second; };
+        for (uint32_t id : authorOrder) {
+            uint64_t total = authorDocs[id].Cardinality();
+            if (!n || (top.size() == n && total <= top.back().second)) break;
+            uint64_t c = docs ? Bitmap::AndCardinality(*docs, authorDocs[id]) : total;
+            if (!c || (top.size() == n && c <= top.back().second)) continue;
+            if (top.size() == n) top.pop_back();
+            top.insert(std::upper_bound(top.begin(), top.end(), std::make_pair(std::string(), c), more), {authorNames[id], c});
+        }
+        return top;
+    }
+
+    // Documents whose author has a sound-alike of every word of `name`
+    // (intersection of the phonetic-key lists), in Books order.
+    std::vector<uint32_t> SoundsLike(const std::string &name, size_t limit) const {
+        std::vector<uint32_t> res;
+        bool first = true;
+        for (auto &t : Terms(name, Author)) {
+            auto it = sounds.find(PhoneticKey(t));
+            if (it == sounds.end()) return {};
+            if (first) res = it->second;
+            else {
+                std::vector<uint32_t> both;
+                std::set_intersection(res.begin(), res.end(), it->second.begin(), it->second.end(), std::back_inserter(both));
+                res.swap(both);
+            }
+            first = false;
+        }
+        if (res.size() > limit) res.resize(limit);
+        return res;
+    }
+
+    // Case-folded words: runs of letters and digits in any script.
+    static std::vector<std::string> Tokenize(const std::string &s) {
+        std::vector<std::string> res;
+        std::string t;
+        for (size_t i = 0; i < s.size();) {
+            uint32_t cp = DecodeUtf8(s, i);
+            bool word = cp < 0x80 ? std::isalnum(int(cp)) != 0
+                                  : !(cp <= 0xBF || cp == 0xD7 || cp == 0xF7 || (cp >= 0x2000 && cp <= 0x206F) ||
+                                      (cp >= 0x3000 && cp <= 0x303F) || cp == 0xFFFD);
+            if (word) AppendUtf8(t, FoldCodepoint(cp));
+            else if (!t.empty()) res.push_back(std::move(t)), t.clear();
+        }
+        if (!t.empty()) res.push_back(std::move(t));
+        return res;
+    }
+    // Index terms of a field's text; titles are stemmed, names are not.
+    static std::vector<std::string> Terms(const std::string &s, Field f) {
+        auto res = Tokenize(s);
+        for (auto &t : res) t = Romanize(f == Title ? StemWord(t) : t);
+        return res;
+    }
+
+private:
+    struct Posting {
+        uint32_t Doc;
+        uint32_t Tf;
+    };
+    struct PostingList {
+        std::vector<Posting> Docs;
+        Bitmap Set; // the same documents, for counting
+        uint32_t MaxTf = 0;
+    };
+    struct Cursor {
+        const std::vector<Posting> *List = nullptr;
+        size_t Pos = 0;
+        int Field = 0;
+        double Weight = 0; // boost * idf * (k1 + 1)
+        double AvgLen = 0;
+        double Bound = 0;  // no posting in this list scores higher
+    };
+
+    std::unordered_map<std::string, PostingList> postings[FieldCount];
+    std::unordered_map<std::string, std::vector<uint32_t>> sounds; // phonetic key of an author word -> docs
+    std::map<std::string, uint32_t> sorted[FieldCount];            // sort key + ISBN -> doc
+    // author facet: case-folded name -> id; display name and documents by id
+    std::unordered_map<std::string, uint32_t> authorIds;
+    std::vector<std::string> authorNames;
+    std::vector<Bitmap> authorDocs;
+    mutable std::vector<uint32_t> authorOrder; // ids, most documents first
+    mutable bool authorOrderStale = false;
+    std::vector<uint32_t> docLen[FieldCount];
+    std::vector<float> staticScore;
+    double maxStatic = 0; // only grows until the next rebuild, which keeps it an upper bound
+    uint64_t totalLen[FieldCount] = {};
+    uint32_t minLen[FieldCount] = {UINT32_MAX, UINT32_MAX};
+
+    // a title word says more about a book than an author word
+    static double FieldBoost(int f) { return f == Title ? 2.0 : 1.0; }
+    static double Norm(uint32_t len, double avgLen) { return K1 * (1 - B + B * len / avgLen); }
+    double Score(const Cursor &c, const Posting &p) const {
+        return c.Weight * p.Tf / (p.Tf + Norm(docLen[c.Field][p.Doc], c.AvgLen));
+    }
+};
+
+struct IntegrityReport {
+    size_t DanglingBookLoans = 0;   // open loans whose book no longer exists
+    size_t DanglingReaderLoans = 0; // open loans whose reader no longer exists
+    size_t DuplicateOpenLoans = 0;  // books with more than one open loan
+    size_t AvailabilityFixes = 0;   // books whose IsAvailable disagreed with open loans
+    bool Ok() const { return !DanglingBookLoans && !DanglingReaderLoans && !DuplicateOpenLoans && !AvailabilityFixes; }
+};
+
+struct PurgeStats {
+    size_t ReadersRemoved = 0;
+    size_t LoansAnonymized = 0;
+};
+
+struct RankedHit {
+    Book Record;
+    double Score = 0;
+};
+
+struct FacetCounts {
+    uint64_t Matches = 0;
+    uint64_t Available = 0;
+    uint64_t Loaned = 0;
+    std::vector<std::pair<std::string, uint64_t>> Authors; // most matches first
+};
+
+struct BrowsePage {
+    std::vector<Book> Books;
+    std::string Next; // opaque cursor for the following page; empty on the last one
+};
+
+class LibraryManager {
+public:
+    std::vector<Book> Books;
+    std::vector<Reader> Readers;
+    std::vector<Loan> Loans;
+
+    // Groups circulation calls so they apply all-or-nothing. Every successful
+    // step pushes its inverse onto an undo log; Rollback (or destroying an
+    // uncommitted transaction) replays it in reverse.
+    class Transaction {
+    public:
+        explicit Transaction(LibraryManager &m) : mgr(m) { mgr.inTx = true; }
+        Transaction(const Transaction &) = delete;
+        Transaction &operator=(const Transaction &) = delete;
+        ~Transaction() { if (!done) Rollback(); }
+
+        bool IssueLoan(const std::string &isbn, int readerId, const std::string &date = now_iso()) {
+            if (done || !mgr.IssueLoan(isbn, readerId, date)) return false;
+            undo.push_back([this, isbn]{
+                // the loan just issued is the last one; undo runs in reverse order
+                mgr.openLoans.erase(isbn);
+                mgr.loanHistory[isbn].pop_back();
+                mgr.Loans.pop_back();
+                if (Book* b = mgr.FindBook(isbn)) {
+                    b->MarkAsAvailable();
+                    mgr.NotePopularity(*b);
+                    mgr.NoteAvailability(*b);
+                }
+            });
+            return true;
+        }
+        bool RecordLoan(const std::string &isbn, int readerId, const std::string &from, const std::string &to) {
+            if (done || !mgr.RecordLoan(isbn, readerId, from, to)) return false;
+            undo.push_back([this, isbn]{
+                auto &h = mgr.loanHistory[isbn];
+                h.erase(std::find(h.begin(), h.end(), mgr.Loans.size() - 1));
+                mgr.Loans.pop_back();
+                if (Book* b = mgr.FindBook(isbn)) mgr.NotePopularity(*b);
+            });
+            return true;
+        }
+        bool ReturnBook(const std::string &isbn, int readerId, const std::string &date = now_iso()) {
+            auto it = mgr.openLoans.find(isbn);
+            if (done || it == mgr.openLoans.end()) return false;
+            size_t idx = it->second;
+            if (!mgr.ReturnBook(isbn, readerId, date)) return false;
+            undo.push_back([this, isbn, idx]{
+                mgr.Loans[idx].ReturnDate = std::nullopt;
+                mgr.openLoans[isbn] = idx;
+                if (Book* b = mgr.FindBook(isbn)) {
+                    b->MarkAsLoaned();
+                    mgr.NoteAvailability(*b);
+                }
+            });
+            return true;
+        }
+        // The whole transaction is published as one Tx event, i.e. one log
+        // line: a torn write loses all of it, never half.
+        void Commit() {
+            undo.clear();
+            done = true;
+            mgr.inTx = false;
+            auto events = std::move(mgr.pendingEvents);
+            mgr.pendingEvents.clear();
+            if (events.size() <= 1) { mgr.Publish(std::move(events)); return; }
+            ChangeEvent e;
+            e.Op = "Tx";
+            e.Time = now_iso();
+            e.Data = {{"Ops", json::array()}};
+            for (auto &x : events) e.Data["Ops"].push_back(json{{"Op", x.Op}, {"Data", x.Data}});
+            mgr.Publish({std::move(e)});
+        }
+        void Rollback() {
+            for (auto it = undo.rbegin(); it != undo.rend(); ++it) (*it)();
+            undo.clear();
+            done = true;
+            mgr.inTx = false;
+            mgr.pendingEvents.clear();
+        }
+
+    private:
+        LibraryManager &mgr;
+        std::vector<std::function<void()>> undo;
+        bool done = false;
+    };
+
+    // Moves an open loan to another reader: return + issue as one transaction.
+    bool TransferLoan(const std::string &isbn, int fromReader, int toReader) {
+        Transaction tx(*this);
+        if (!tx.ReturnBook(isbn, fromReader) || !tx.IssueLoan(isbn, toReader)) return false;
+        tx.Commit();
+        return true;
+    }
+
+    // Desk workflow "return one book, issue another to the same reader".
+    bool ExchangeBook(const std::string &returnIsbn, const std::string &issueIsbn, int readerId) {
+        Transaction tx(*this);
+        if (!tx.ReturnBook(returnIsbn, readerId) || !tx.IssueLoan(issueIsbn, readerId)) return false;
+        tx.Commit();
+        return true;
+    }
+
+    // Change feed: subscribers are called synchronously after each mutation (or
+    // transaction commit); if a log is open, events are appended to it as JSON lines.
+    void Subscribe(std::function<void(const ChangeEvent &)> fn) { subscribers.push_back(std::move(fn)); }
+
+    void OpenChangeLog(const std::string &path) {
+        changeLogPath = path;
+        // continue numbering after the last event already in the log
+        ChangeLogReader rd(path);
+        for (auto &e : rd.Poll()) lastSeq = std::max(lastSeq, e.Seq);
+    }
+
+    uint64_t LastSeq() const { return lastSeq; }
+
+    // Forces the change log to stable storage.
+    void SyncChangeLog() const {
+#ifndef _WIN32
+        if (changeLogPath.empty()) return;
+        int fd = open(changeLogPath.c_str(), O_WRONLY | O_APPEND);
+        if (fd >= 0) { fsync(fd); close(fd); }
+#endif
+    }
+
+    // Marks "the saved files now equal the in-memory state" in the feed, so a
+    // follower knows where to start replaying after loading them.
+    void Checkpoint() { Emit("Checkpoint", json::object()); }
+
+    // Replays an event from another instance's feed. Checkpoints are handled by
+    // the caller (JournalFollower) since they mean "reload the snapshot".
+    bool Apply(const ChangeEvent &e) {
+        const json &d = e.Data;
+        if (e.Op == "AddBook") return AddBook(Book::from_json(d));
+        if (e.Op == "RemoveBook") return RemoveBook(d.value("ISBN", ""));
+        if (e.Op == "AddReader") return AddReader(Reader::from_json(d));
+        if (e.Op == "RemoveReader") return RemoveReader(d.value("Id", 0));
+        if (e.Op == "IssueLoan") return IssueLoan(d.value("BookISBN", ""), d.value("ReaderId", 0), d.value("LoanDate", ""));
+        if (e.Op == "ReturnBook") return ReturnBook(d.value("BookISBN", ""), d.value("ReaderId", 0), d.value("ReturnDate", ""));
+        if (e.Op == "RecordLoan") return RecordLoan(d.value("BookISBN", ""), d.value("ReaderId", 0), d.value("LoanDate", ""), d.value("ReturnDate", ""));
+        if (e.Op == "Purge") { PurgeBefore(d.value("Cutoff", "")); return true; }
+        if (e.Op == "Repair") { CheckIntegrity(true); return true; }
+        if (e.Op == "ExportBooks") {
+            DropBooks(std::unordered_set<std::string>(d["ISBNs"].begin(), d["ISBNs"].end()));
+            return true;
+        }
+        if (e.Op == "ImportBook") return ImportBooks(json::array({d})) == 1;
+        if (e.Op == "ImportLoans") return ImportLoans(d.value("ISBN", ""), d.value("Offset", size_t(0)), d["Loans"]);
+        if (e.Op == "Tx") {
+            // replayed all-or-nothing like the original
+            Transaction tx(*this);
+            for (auto &op : d.value("Ops", json::array())) {
+                const json &od = op["Data"];
+                std::string isbn = od.value("BookISBN", "");
+                int rid = od.value("ReaderId", 0);
+                std::string name = op.value("Op", "");
+                bool ok = name == "IssueLoan" ? tx.IssueLoan(isbn, rid, od.value("LoanDate", ""))
+                        : name == "ReturnBook" ? tx.ReturnBook(isbn, rid, od.value("ReturnDate", ""))
+                        : name == "RecordLoan" ? tx.RecordLoan(isbn, rid, od.value("LoanDate", ""), od.value("ReturnDate", ""))
+                        : false;
+                if (!ok) return false;
+            }
+            tx.Commit();
+            return true;
+        }
+        return false;
+    }
+
+    bool AddBook(const Book &in) {
+        if (FindBook(in.ISBN)) return false;
+        Book b = in;
+        if (b.Added.empty()) b.Added = now_iso(); // the event carries it, so replicas agree
+        b.IsAvailable = !openLoans.count(b.ISBN); // derived from loans, not taken from the caller
+        Books.push_back(b);
+        if (!textStale && textIndex.Docs() == Books.size() - 1) textIndex.Add(b);
+        if (!availStale && availableDocs == Books.size() - 1) {
+            if (b.IsAvailable) available.Add(uint32_t(Books.size() - 1));
+            availableDocs = Books.size();
+        }
+        Emit("AddBook", b.to_json());
+        return true;
+    }
+
+    bool RemoveBook(const std::string &isbn) {
+        auto it = std::find_if(Books.begin(), Books.end(), [&](const Book &x){ return x.ISBN == isbn; });
+        if (it == Books.end()) return false;
+        // only remove if available
+        if (openLoans.count(isbn)) return false;
+        Books.erase(it);
+        textStale = availStale = true;
+        Emit("RemoveBook", json{{"ISBN", isbn}});
+        return true;
+    }
+
+    int NextReaderId() const {
+        int maxId = 0;
+        for (auto &r : Readers) if (r.Id > maxId) maxId = r.Id;
+        return maxId + 1;
+    }
+
+    bool AddReader(const Reader &in) {
+        if (std::any_of(Readers.begin(), Readers.end(), [&](const Reader &x){ return x.Id == in.Id; })) return false;
+        Reader r = in;
+        if (r.Registered.empty()) r.Registered = now_iso(); // the event carries it, so replicas agree
+        Readers.push_back(r);
+        Emit("AddReader", r.to_json());
+        return true;
+    }
+
+    bool RemoveReader(int id) {
+        auto it = std::find_if(Readers.begin(), Readers.end(), [&](const Reader &x){ return x.Id == id; });
+        if (it == Readers.end()) return false;
+        // remove active loans (single compaction pass instead of erase per loan), freeing their books
+        Loans.erase(std::remove_if(Loans.begin(), Loans.end(), [&](const Loan &l){ return l.ReaderId == id && !l.ReturnDate; }), Loans.end());
+        Readers.erase(it);
+        RebuildIndexes();
+        Emit("RemoveReader", json{{"Id", id}});
+        return true;
+    }
+
+    bool IssueLoan(const std::string &isbn, int readerId, const std::string &date = now_iso()) {
+        Book* b = FindBook(isbn);
+        if (!b) return false;
+        if (openLoans.count(isbn)) return false;
+        if (!FindReader(readerId)) return false;
+        // a back-dated issue (replay, kiosk) must start after the book's last
+        // return; that also keeps the history in LoanDate order
+        auto h = loanHistory.find(isbn);
+        if (h != loanHistory.end() && !h->second.empty() && date < Loans[h->second.back()].ReturnDate.value_or("")) return false;
+        Loan ln;
+        ln.BookISBN = isbn;
+        ln.ReaderId = readerId;
+        ln.LoanDate = date;
+        ln.ReturnDate = std::nullopt;
+        Loans.push_back(ln);
+        openLoans[isbn] = Loans.size() - 1;
+        loanHistory[isbn].push_back(Loans.size() - 1);
+        NotePopularity(*b);
+        b->MarkAsLoaned();
+        NoteAvailability(*b);
+        Emit("IssueLoan", ln.to_json());
+        return true;
+    }
+
+    bool ReturnBook(const std::string &isbn, int readerId, const std::string &date = now_iso()) {
+        auto it = openLoans.find(isbn);
+        if (it == openLoans.end() || Loans[it->second].ReaderId != readerId) return false;
+        if (date < Loans[it->second].LoanDate) return false;
+        Loan &ln = Loans[it->second];
+        ln.ReturnDate = date;
+        openLoans.erase(it);
+        Book* b = FindBook(isbn);
+        if (b) {
+            b->MarkAsAvailable();
+            NoteAvailability(*b);
+        }
+        Emit("ReturnBook", ln.to_json());
+        return true;
+    }
+
+    // Records a loan that already ended (issued and returned at an offline
+    // desk) in its place in the book's history; fails if it overlaps another
+    // loan of the book.
+    bool RecordLoan(const std::string &isbn, int readerId, const std::string &from, const std::string &to) {
+        Book* b = FindBook(isbn);
+        if (!b || !FindReader(readerId) || to < from) return false;
+        auto &h = loanHistory[isbn];
+        auto pos = std::upper_bound(h.begin(), h.end(), from, [&](const std::string &t, size_t i){ return t < Loans[i].LoanDate; });
+        if (pos != h.end() && Loans[*pos].LoanDate < to) return false; // the next loan starts before this one ends
+        if (pos != h.begin() && from < Loans[*(pos - 1)].ReturnDate.value_or("\x7f")) return false; // the previous one is still out
+        Loan ln{isbn, readerId, from, to};
+        Loans.push_back(ln);
+        h.insert(pos, Loans.size() - 1);
+        NotePopularity(*b);
+        Emit("RecordLoan", ln.to_json());
+        return true;
+    }
+
+    // Retention job: removes readers with no activity in the last `years` years and
+    // no open loans, and anonymizes closed loans older than that (ReaderId = 0).
+    // Registering counts as activity; readers with neither loans nor a
+    // registration date (older data) are kept, since their age is unknown.
+    // Loans are kept, so per-book circulation counts stay intact.
+    PurgeStats PurgeAndAnonymize(int years) { return PurgeBefore(iso_years_ago(years)); }
+
+    PurgeStats PurgeBefore(const std::string &cutoff) {
+        PurgeStats st;
+        // one pass over loans: who is still active
+        std::unordered_set<int> active, borrowed;
+        for (auto &l : Loans) {
+            borrowed.insert(l.ReaderId);
+            if (!l.ReturnDate || l.LoanDate >= cutoff || *l.ReturnDate >= cutoff) active.insert(l.ReaderId);
+        }
+        auto stale = [&](const Reader &r) {
+            if (active.count(r.Id)) return false;
+            if (r.Registered.empty()) return borrowed.count(r.Id) > 0;
+            return r.Registered < cutoff;
+        };
+        // compact readers in place
+        auto rend = std::remove_if(Readers.begin(), Readers.end(), stale);
+        st.ReadersRemoved = Readers.end() - rend;
+        Readers.erase(rend, Readers.end());
+        // one pass over loans: anonymize old history
+        for (auto &l : Loans) {
+            if (l.ReaderId != 0 && l.ReturnDate && *l.ReturnDate < cutoff) {
+                l.ReaderId = 0;
+                ++st.LoansAnonymized;
+            }
+        }
+        Emit("Purge", json{{"Cutoff", cutoff}});
+        return st;
+    }
+
+    // Point-in-time queries ("who held this book at ts"). Loans already form the
+    // circulation history; the per-book index keeps a lookup at O(log loans of that book).
+    std::optional<int> HolderAt(const std::string &isbn, const std::string &ts) const {
+        auto it = loanHistory.find(isbn);
+        if (it == loanHistory.end()) return std::nullopt;
+        const auto &h = it->second;
+        // last loan that started at or before ts
+        auto pos = std::upper_bound(h.begin(), h.end(), ts, [&](const std::string &t, size_t i){ return t < Loans[i].LoanDate; });
+        if (pos == h.begin()) return std::nullopt;
+        const Loan &l = Loans[*(pos - 1)];
+        if (l.ReturnDate && *l.ReturnDate <= ts) return std::nullopt;
+        return l.ReaderId;
+    }
+    // Was the book on the shelf at ts? false if it was loaned or not yet
+    // added; nullopt if that cannot be told from what is kept: removal dates
+    // are not recorded, and books saved before Added existed are only known
+    // to exist from their first loan on.
+    std::optional<bool> WasAvailableAt(const std::string &isbn, const std::string &ts) const {
+        if (HolderAt(isbn, ts)) return false;
+        const Book *b = FindBook(isbn);
+        if (b && !b->Added.empty()) return b->Added <= ts;
+        // otherwise it certainly existed between its first and last recorded loan event
+        auto it = loanHistory.find(isbn);
+        if (it != loanHistory.end() && !it->second.empty()) {
+            const Loan &first = Loans[it->second.front()], &last = Loans[it->second.back()];
+            if (first.LoanDate <= ts && (b || !last.ReturnDate || ts <= *last.ReturnDate)) return true;
+        }
+        return std::nullopt;
+    }
+
+    std::optional<Book> GetBook(const std::string &isbn) const {
+        const Book* b = FindBook(isbn);
+        return b ? std::optional<Book>(*b) : std::nullopt;
+    }
+
+    // Books matching `pred` with their loan history, as {Book, Loans} items,
+    // until about maxBytes of JSON or until cancelled. A book whose history
+    // alone is over maxBytes comes without loans and with LoanCount set; its
+    // loans are then fetched in pages with BookLoans.
+    json CollectBooks(const std::function<bool(const Book &)> &pred, size_t maxBytes,
+                      const CancelToken &cancel = CancelToken()) const {
+        json items = json::array();
+        size_t bytes = 0;
+        for (size_t i = 0; i < Books.size(); ++i) {
+            const Book &b = Books[i];
+            if (bytes >= maxBytes || cancel.Cancelled(i)) break;
+            if (!pred(b)) continue;
+            json item{{"Book", b.to_json()}, {"Loans", json::array()}};
+            auto h = loanHistory.find(b.ISBN);
+            if (h != loanHistory.end()) for (size_t i : h->second) item["Loans"].push_back(Loans[i].to_json());
+            size_t size = item.dump().size();
+            if (size > maxBytes) {
+                item["LoanCount"] = item["Loans"].size();
+                item["Loans"] = json::array();
+                size = item.dump().size();
+            }
+            bytes += size;
+            items.push_back(std::move(item));
+        }
+        return items;
+    }
+
+    // A page of a book's loan history, oldest first, of about maxBytes of JSON.
+    json BookLoans(const std::string &isbn, size_t offset, size_t maxBytes) const {
+        json res = json::array();
+        auto h = loanHistory.find(isbn);
+        size_t bytes = 0;
+        if (h != loanHistory.end())
+            for (size_t i = offset; i < h->second.size() && bytes < maxBytes; ++i) {
+                res.push_back(Loans[h->second[i]].to_json());
+                bytes += res.back().dump().size();
+            }
+        return res;
+    }
+
+    // Removes books and their loans (also loans of ISBNs with no book here),
+    // e.g. once another shard has imported them.
+    size_t DropBooks(const std::unordered_set<std::string> &isbns) {
+        size_t before = Books.size(), loansBefore = Loans.size();
+        Books.erase(std::remove_if(Books.begin(), Books.end(), [&](const Book &b){ return isbns.count(b.ISBN) > 0; }), Books.end());
+        Loans.erase(std::remove_if(Loans.begin(), Loans.end(), [&](const Loan &l){ return isbns.count(l.BookISBN) > 0; }), Loans.end());
+        if (Books.size() == before && Loans.size() == loansBefore) return 0;
+        textStale = true;
+        RebuildIndexes();
+        Emit("ExportBooks", json{{"ISBNs", json(isbns)}});
+        return before - Books.size();
+    }
+
+    // Moves books with their loan history out of this instance (CollectBooks,
+    // then DropBooks); what was taken before a cancel is still moved.
+    json ExportBooks(const std::function<bool(const Book &)> &pred, size_t maxBytes,
+                     const CancelToken &cancel = CancelToken()) {
+        json items = CollectBooks(pred, maxBytes, cancel);
+        std::unordered_set<std::string> taken;
+        for (auto &item : items) taken.insert(item["Book"].value("ISBN", ""));
+        DropBooks(taken);
+        return items;
+    }
+
+    // Counterpart of ExportBooks; returns how many books were new here.
+    size_t ImportBooks(const json &items) {
+        size_t added = 0;
+        std::unordered_set<std::string> seen;
+        for (auto &b : Books) seen.insert(b.ISBN);
+        for (auto &item : items) {
+            Book b = Book::from_json(item["Book"]);
+            if (!seen.insert(b.ISBN).second) continue;
+            Books.push_back(b);
+            for (auto &l : item["Loans"]) Loans.push_back(Loan::from_json(l));
+            Emit("ImportBook", item);
+            ++added;
+        }
+        textStale = true;
+        RebuildIndexes();
+        return added;
+    }
+
+    // Appends a page of an imported book's history, starting at its
+    // `offset`-th loan. Loans already here (a retried page) are skipped, so
+    // pages can be resent; a gap fails.
+    bool ImportLoans(const std::string &isbn, size_t offset, const json &loans) {
+        if (!FindBook(isbn)) return false;
+        auto h = loanHistory.find(isbn);
+        size_t have = h == loanHistory.end() ? 0 : h->second.size();
+        if (offset > have) return false;
+        if (offset + loans.size() <= have) return true;
+        for (size_t i = have - offset; i < loans.size(); ++i) Loans.push_back(Loan::from_json(loans[i]));
+        RebuildIndexes();
+        Emit("ImportLoans", json{{"ISBN", isbn}, {"Offset", offset}, {"Loans", loans}});
+        return true;
+    }
+
+    // A cancelled search returns the matches found before it stopped.
+    std::vector<Book> SearchBooks(const std::string &term, const CancelToken &cancel = CancelToken()) const {
+        if (term.empty()) return Books;
+        std::string q = Lower(term);
+        std::vector<Book> res;
+        for (size_t i = 0; i < Books.size(); ++i) {
+            if (cancel.Cancelled(i)) break;
+            const Book &b = Books[i];
+            if (Lower(b.Title).find(q) != std::string::npos || Lower(b.Author).find(q) != std::string::npos)
+                res.push_back(b);
+        }
+        return res;
+    }
+
+    // Best k books for a free-text query by BM25 relevance over Title and
+    // Author (whole words, any order), most relevant first. Among similar
+    // matches the more borrowed book wins: every loan ever issued adds to a
+    // per-book popularity score kept in the index.
+    std::vector<RankedHit> SearchRanked(const std::string &query, size_t k = 20, const CancelToken &cancel = CancelToken()) const {
+        SyncTextIndex();
+        std::vector<RankedHit> res;
+        for (auto &h : textIndex.TopK(query, k, cancel)) res.push_back({Books[h.Doc], h.Score});
+        return res;
+    }
+
+    // Facet counts for the books SearchRanked would consider (every book for
+    // an empty query): counted on bitmaps, no Book is copied.
+    FacetCounts SearchFacets(const std::string &query, size_t topAuthors = 10) const {
+        SyncTextIndex();
+        SyncAvailability();
+        FacetCounts fc;
+        bool all = TextIndex::Tokenize(query).empty();
+        Bitmap match = all ? Bitmap() : textIndex.Matching(query);
+        fc.Matches = all ? Books.size() : match.Cardinality();
+        fc.Available = all ? available.Cardinality() : Bitmap::AndCardinality(match, available);
+        fc.Loaned = fc.Matches - fc.Available;
+        fc.Authors = textIndex.TopAuthors(all ? nullptr : &match, topAuthors);
+        return fc;
+    }
+
+    // Alphabetical listing by Title or Author from the ordered index, a page
+    // at a time: pass the previous page's Next as `cursor` to continue. The
+    // first page starts at `from` (e.g. "K"); `to` ends the range (exclusive).
+    // Each page costs O(log n + limit).
+    BrowsePage Browse(TextIndex::Field by, const std::string &cursor, size_t limit,
+                      const std::string &from = "", const std::string &to = "") const {
+        SyncTextIndex();
+        BrowsePage page;
+        for (uint32_t doc : textIndex.Ordered(by, from, to, cursor, limit, page.Next)) page.Books.push_back(Books[doc]);
+        return page;
+    }
+
+    // Books by authors whose name sounds like `name` ("Auezov" finds "Әуезов"
+    // and "Awezov"); a lookup in the phonetic author index.
+    std::vector<Book> SearchAuthorSounds(const std::string &name, size_t limit = 100) const {
+        SyncTextIndex();
+        std::vector<Book> res;
+        for (uint32_t doc : textIndex.SoundsLike(name, limit)) res.push_back(Books[doc]);
+        return res;
+    }
+
+    // Each file is written next to itself and renamed over the old one, so a
+    // crash mid-save leaves the previous version whole. False if a write failed.
+    bool Save(const std::string &booksFile, const std::string &readersFile, const std::string &loansFile) const {
+        json jb = json::array();
+        for (auto &b : Books) jb.push_back(b.to_json());
+        json jr = json::array();
+        for (auto &r : Readers) jr.push_back(r.to_json());
+        json jl = json::array();
+        for (auto &l : Loans) jl.push_back(l.to_json());
+        return WriteFile(booksFile, jb.dump(4)) && WriteFile(readersFile, jr.dump(4)) && WriteFile(loansFile, jl.dump(4));
+    }
+
+    // A missing file loads as empty. A file that does not parse fails the
+    // load and leaves the current data as it was.
+    bool Load(const std::string &booksFile, const std::string &readersFile, const std::string &loansFile) {
+        std::vector<Book> books;
+        std::vector<Reader> readers;
+        std::vector<Loan> loans;
+        try {
+            std::ifstream f1(booksFile);
+            if (f1) {
+                json jb; f1 >> jb;
+                for (auto &x : jb) books.push_back(Book::from_json(x));
+            }
+            std::ifstream f2(readersFile);
+            if (f2) {
+                json jr; f2 >> jr;
+                for (auto &x : jr) readers.push_back(Reader::from_json(x));
+            }
+            std::ifstream f3(loansFile);
+            if (f3) {
+                json jl; f3 >> jl;
+                for (auto &x : jl) loans.push_back(Loan::from_json(x));
+            }
+        } catch (const std::exception &) {
+            return false;
+        }
+        Books = std::move(books);
+        Readers = std::move(readers);
+        Loans = std::move(loans);
+        textStale = true;
+        RebuildIndexes();
+        return true;
+    }
+
+    // Cross-checks loans against books and readers (hash joins, loans split across
+    // pool tasks) and recomputes availability from open loans. With repair=true,
+    // dangling open loans are dropped, a book with several open loans keeps only
+    // the latest one (the others are closed at its LoanDate) and IsAvailable is
+    // corrected.
+    IntegrityReport CheckIntegrity(bool repair) {
+        IntegrityReport rep;
+        std::unordered_map<std::string, size_t> bookIdx;
+        for (size_t i = 0; i < Books.size(); ++i) bookIdx.emplace(Books[i].ISBN, i);
+        std::unordered_set<int> readerIds;
+        for (auto &r : Readers) readerIds.insert(r.Id);
+
+        // openBooks: (book index, loan index) of every open loan with a valid book and reader
+        struct Part { std::vector<size_t> dangling; std::vector<std::pair<size_t, size_t>> openBooks; size_t badBook = 0, badReader = 0; };
+        WorkStealingPool &pool = DefaultPool();
+        size_t chunk = std::max<size_t>(4096, (Loans.size() + pool.Size() - 1) / pool.Size());
+        std::vector<std::future<Part>> futs;
+        for (size_t from = 0; from < Loans.size(); from += chunk) {
+            size_t to = std::min(Loans.size(), from + chunk);
+            futs.push_back(pool.Submit([&, from, to]{
+                Part p;
+                for (size_t i = from; i < to; ++i) {
+                    const Loan &l = Loans[i];
+                    if (l.ReturnDate) continue;
+                    auto bit = bookIdx.find(l.BookISBN);
+                    bool badBook = bit == bookIdx.end();
+                    bool badReader = !readerIds.count(l.ReaderId);
+                    if (badBook) ++p.badBook;
+                    if (badReader) ++p.badReader;
+                    if (badBook || badReader) p.dangling.push_back(i);
+                    else p.openBooks.emplace_back(bit->second, i);
+                }
+                return p;
+            }));
+        }
+
+        std::vector<size_t> openCount(Books.size(), 0);
+        std::vector<size_t> dangling;
+        std::vector<std::pair<size_t, size_t>> open;
+        for (auto &f : futs) {
+            Part p = pool.Get(f);
+            rep.DanglingBookLoans += p.badBook;
+            rep.DanglingReaderLoans += p.badReader;
+            dangling.insert(dangling.end(), p.dangling.begin(), p.dangling.end());
+            for (auto &bl : p.openBooks) ++openCount[bl.first];
+            if (repair) open.insert(open.end(), p.openBooks.begin(), p.openBooks.end());
+        }
+        // duplicates: keep the open loan with the latest LoanDate (the later
+        // record on a tie) and return the others when it started
+        std::unordered_map<size_t, size_t> keep;
+        if (repair) {
+            for (auto &bl : open) {
+                if (openCount[bl.first] < 2) continue;
+                auto it = keep.emplace(bl.first, bl.second).first;
+                if (Loans[it->second].LoanDate <= Loans[bl.second].LoanDate) it->second = bl.second;
+            }
+            for (auto &bl : open) {
+                auto it = keep.find(bl.first);
+                if (it != keep.end() && it->second != bl.second) Loans[bl.second].ReturnDate = Loans[it->second].LoanDate;
+            }
+        }
+        for (size_t i = 0; i < Books.size(); ++i) {
+            if (openCount[i] > 1) ++rep.DuplicateOpenLoans;
+            bool expected = openCount[i] == 0;
+            if (Books[i].IsAvailable != expected) {
+                ++rep.AvailabilityFixes;
+                if (repair) Books[i].IsAvailable = expected;
+            }
+        }
+        if (repair && (!dangling.empty() || !keep.empty())) {
+            std::vector<bool> drop(Loans.size(), false);
+            for (size_t i : dangling) drop[i] = true;
+            size_t w = 0;
+            for (size_t i = 0; i < Loans.size(); ++i) {
+                if (drop[i]) continue;
+                if (w != i) Loans[w] = std::move(Loans[i]);
+                ++w;
+            }
+            Loans.resize(w);
+            RebuildIndexes();
+        }
+        if (repair && !rep.Ok()) Emit("Repair", json::object());
+        return rep;
+    }
+
+    std::vector<Book> AvailableBooks(const CancelToken &cancel = CancelToken()) const {
+        std::vector<Book> res;
+        for (size_t i = 0; i < Books.size() && !cancel.Cancelled(i); ++i)
+            if (Books[i].IsAvailable) res.push_back(Books[i]);
+        return res;
+    }
+    std::vector<Loan> ActiveLoans(const CancelToken &cancel = CancelToken()) const {
+        std::vector<Loan> res;
+        for (size_t i = 0; i < Loans.size() && !cancel.Cancelled(i); ++i)
+            if (!Loans[i].ReturnDate) res.push_back(Loans[i]);
+        return res;
+    }
+
+private:
+    // tmp file, fsync, rename; Windows cannot rename over an existing file
+    static bool WriteFile(const std::string &path, const std::string &data) {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::trunc | std::ios::binary);
+            f << data;
+            f.flush();
+            if (!f) { std::remove(tmp.c_str()); return false; }
+        }
+#ifndef _WIN32
+        int fd = open(tmp.c_str(), O_WRONLY);
+        if (fd >= 0) { fsync(fd); close(fd); }
+#else
+        std::remove(path.c_str());
+#endif
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    std::vector<std::function<void(const ChangeEvent &)>> subscribers;
+    std::string changeLogPath;
+    uint64_t lastSeq = 0;
+    bool inTx = false;
+    std::vector<ChangeEvent> pendingEvents;
+
+    void Emit(const std::string &op, json data) {
+        ChangeEvent e;
+        e.Op = op;
+        e.Time = now_iso();
+        e.Data = std::move(data);
+        if (inTx) { pendingEvents.push_back(std::move(e)); return; }
+        Publish({std::move(e)});
+    }
+
+    void Publish(std::vector<ChangeEvent> events) {
+        if (events.empty()) return;
+        for (auto &e : events) e.Seq = ++lastSeq;
+        if (!changeLogPath.empty()) {
+            std::string buf;
+            for (auto &e : events) buf += e.to_json().dump() + "\n";
+            std::ofstream out(changeLogPath, std::ios::app | std::ios::binary);
+            out << buf;
+            out.flush();
+        }
+        for (auto &e : events) for (auto &fn : subscribers) fn(e);
+    }
+
+    // Built lazily: appended to by AddBook, rebuilt by the next ranked query
+    // after books were removed, reloaded or edited in place (detected by the
+    // count). Queries are serialized by the callers like every other call.
+    mutable TextIndex textIndex;
+    mutable bool textStale = true;
+
+    // log-damped, so a hundred loans help a little more than ten, not ten times more
+    static constexpr double PopularityWeight = 0.25;
+    double Popularity(const std::string &isbn) const {
+        auto it = loanHistory.find(isbn);
+        return it == loanHistory.end() ? 0 : PopularityWeight * std::log1p(double(it->second.size()));
+    }
+    void NotePopularity(const Book &b) {
+        if (textStale || textIndex.Docs() != Books.size()) return;
+        textIndex.SetStatic(uint32_t(&b - Books.data()), Popularity(b.ISBN));
+    }
+
+    // positions of books on the shelf, for the availability facet; kept
+    // current by IssueLoan/ReturnBook, rebuilt after RebuildIndexes
+    mutable Bitmap available;
+    mutable size_t availableDocs = 0;
+    mutable bool availStale = true;
+
+    void SyncAvailability() const {
+        if (!availStale && availableDocs == Books.size()) return;
+        available = Bitmap();
+        for (uint32_t i = 0; i < Books.size(); ++i) if (Books[i].IsAvailable) available.Add(i);
+        availableDocs = Books.size();
+        availStale = false;
+    }
+    void NoteAvailability(const Book &b) {
+        if (availStale || availableDocs != Books.size()) return;
+        uint32_t pos = uint32_t(&b - Books.data());
+        if (b.IsAvailable) available.Add(pos);
+        else available.Remove(pos);
+    }
+
+    void SyncTextIndex() const {
+        if (!textStale && textIndex.Docs() == Books.size()) return;
+        textIndex.Clear();
+        for (auto &b : Books) textIndex.Add(b);
+        for (uint32_t i = 0; i < Books.size(); ++i) textIndex.SetStatic(i, Popularity(Books[i].ISBN));
+        textStale = false;
+    }
+
+    // ISBN -> index in Loans of its open loan; the source of truth for availability
+    std::unordered_map<std::string, size_t> openLoans;
+
+    // ISBN -> indexes in Loans ordered by LoanDate
+    std::unordered_map<std::string, std::vector<size_t>> loanHistory;
+
+    void RebuildIndexes() {
+        availStale = true;
+        openLoans.clear();
+        loanHistory.clear();
+        for (size_t i = 0; i < Loans.size(); ++i) {
+            if (!Loans[i].ReturnDate) openLoans[Loans[i].BookISBN] = i;
+            loanHistory[Loans[i].BookISBN].push_back(i);
+        }
+        for (auto &h : loanHistory) {
+            std::stable_sort(h.second.begin(), h.second.end(), [&](size_t a, size_t b){ return Loans[a].LoanDate < Loans[b].LoanDate; });
+        }
+        for (auto &b : Books) b.IsAvailable = !openLoans.count(b.ISBN);
+    }
+
+    static std::string Lower(const std::string &s) { return FoldCase(s); }
+
+    Book* FindBook(const std::string &isbn) {
+        auto it = std::find_if(Books.begin(), Books.end(), [&](const Book &b){ return b.ISBN == isbn; });
+        return it == Books.end() ? nullptr : &(*it);
+    }
+    const Book* FindBook(const std::string &isbn) const {
+        auto it = std::find_if(Books.begin(), Books.end(), [&](const Book &b){ return b.ISBN == isbn; });
+        return it == Books.end() ? nullptr : &(*it);
+    }
+    Reader* FindReader(int id) {
+        auto it = std::find_if(Readers.begin(), Readers.end(), [&](const Reader &r){ return r.Id == id; });
+        return it == Readers.end() ? nullptr : &(*it);
+    }
+    const Reader* FindReader(int id) const {
+        auto it = std::find_if(Readers.begin(), Readers.end(), [&](const Reader &r){ return r.Id == id; });
+        return it == Readers.end() ? nullptr : &(*it);
+    }
+};
+
+// Read replica: loads the primary's saved files and keeps up with it by
+// tailing its change log. Replay starts after the last Checkpoint, which the
+// primary writes whenever the saved files match its state.
+class JournalFollower {
+public:
+    JournalFollower(LibraryManager &m, std::string books, std::string readers, std::string loans, const std::string &log)
+        : mgr(m), booksFile(std::move(books)), readersFile(std::move(readers)), loansFile(std::move(loans)), reader(log) {}
+
+    // False if the saved files do not parse.
+    bool Start() {
+        auto events = reader.Poll();
+        size_t from = 0;
+        for (size_t i = 0; i < events.size(); ++i) if (events[i].Op == "Checkpoint") from = i + 1;
+        if (!mgr.Load(booksFile, readersFile, loansFile)) return false;
+        for (size_t i = from; i < events.size(); ++i) mgr.Apply(events[i]);
+        return true;
+    }
+
+    // Applies everything appended since the last call; returns the number of events.
+    size_t CatchUp() {
+        auto events = reader.Poll();
+        for (auto &e : events) {
+            if (e.Op == "Checkpoint") mgr.Load(booksFile, readersFile, loansFile);
+            else mgr.Apply(e);
+        }
+        return events.size();
+    }
+
+private:
+    LibraryManager &mgr;
+    std::string booksFile, readersFile, loansFile;
+    ChangeLogReader reader;
+};
+
+struct FederatedHit {
+    Book Record;                          // first copy seen; IsAvailable is network-wide
+    std::vector<std::string> Branches;    // branches holding a copy
+    std::vector<std::string> AvailableAt; // branches where a copy is on the shelf
+};
+
+// Read-only view over several branches, each with its own LibraryManager.
+// Queries run on all branches in parallel; a branch that does not answer
+// within the timeout is left out and reported in `timedOut`.
+class Federation {
+public:
+    void AddBranch(const std::string &name, const LibraryManager *mgr) { branches.push_back({name, mgr}); }
+
+    std::vector<FederatedHit> SearchBooks(const std::string &term, std::chrono::milliseconds timeout,
+                                          std::vector<std::string> *timedOut = nullptr) const {
+        auto results = FanOut([term](const LibraryManager &m, const CancelToken &c){ return m.SearchBooks(term, c); }, timeout, timedOut);
+        std::vector<FederatedHit> hits;
+        std::unordered_map<std::string, size_t> byIsbn;
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (!results[i]) continue;
+            for (auto &b : *results[i]) {
+                auto it = byIsbn.find(b.ISBN);
+                if (it == byIsbn.end()) {
+                    it = byIsbn.emplace(b.ISBN, hits.size()).first;
+                    hits.push_back({b, {}, {}});
+                    hits.back().Record.IsAvailable = false;
+                }
+                FederatedHit &h = hits[it->second];
+                h.Branches.push_back(branches[i].first);
+                if (b.IsAvailable) { h.AvailableAt.push_back(branches[i].first); h.Record.IsAvailable = true; }
+            }
+        }
+        return hits;
+    }
+
+    // Branches where the book is on the shelf right now.
+    std::vector<std::string> AvailableAt(const std::string &isbn, std::chrono::milliseconds timeout,
+                                         std::vector<std::string> *timedOut = nullptr) const {
+        auto results = FanOut([isbn](const LibraryManager &m, const CancelToken &){
+            std::vector<Book> r;
+            for (auto &b : m.Books) if (b.ISBN == isbn && b.IsAvailable) r.push_back(b);
+            return r;
+        }, timeout, timedOut);
+        std::vector<std::string> res;
+        for (size_t i = 0; i < results.size(); ++i) if (results[i] && !results[i]->empty()) res.push_back(branches[i].first);
+        return res;
+    }
+
+private:
+    std::vector<std::pair<std::string, const LibraryManager *>> branches;
+
+    // Runs `q` on every branch as a pool task. A slow branch cannot hold up
+    // the caller past the deadline, and its scan is told to stop then.
+    template <class Q>
+    std::vector<std::optional<std::vector<Book>>> FanOut(Q q, std::chrono::milliseconds timeout, std::vector<std::string> *timedOut) const {
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        CancelToken cancel = CancelToken::After(timeout);
+        WorkStealingPool &pool = DefaultPool();
+        std::vector<std::future<std::optional<std::vector<Book>>>> futs;
+        for (auto &br : branches) {
+            const LibraryManager *m = br.second;
+            // a scan cut short by the deadline is as good as no answer
+            futs.push_back(pool.Submit([m, q, cancel]() -> std::optional<std::vector<Book>> {
+                auto r = q(*m, cancel);
+                if (cancel.Cancelled()) return std::nullopt;
+                return r;
+            }));
+        }
+        std::vector<std::optional<std::vector<Book>>> res(branches.size());
+        for (size_t i = 0; i < futs.size(); ++i) {
+            if (pool.WaitUntil(futs[i], deadline)) res[i] = futs[i].get();
+            if (!res[i] && timedOut) timedOut->push_back(branches[i].first);
+        }
+        cancel.Cancel();
+        return res;
+    }
+};
+
+// FNV-1a with a splitmix64 finalizer, so short similar keys spread evenly.
+static uint64_t hash64(const std::string &s) {
+    uint64_t h = 1469598103934665603ull;
+    for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 27; h *= 0x94d049bb133111ebull;
+    return h ^ (h >> 31);
+}
+
+// Consistent hashing of keys (ISBNs) onto nodes. Each node gets `vnodes`
+// points on the ring, so adding or removing a node only moves the keys
+// between it and its ring neighbours (about 1/N of them).
+class HashRing {
+public:
+    explicit HashRing(size_t vnodes = 64) : vnodes(vnodes) {}
+
+    void Add(int node) {
+        for (size_t i = 0; i < vnodes; ++i) ring[hash64(std::to_string(node) + "#" + std::to_string(i))] = node;
+    }
+    void Remove(int node) {
+        for (auto it = ring.begin(); it != ring.end();) it = it->second == node ? ring.erase(it) : std::next(it);
+    }
+    int Owner(const std::string &key) const {
+        if (ring.empty()) return -1;
+        auto it = ring.lower_bound(hash64(key));
+        return it == ring.end() ? ring.begin()->second : it->second;
+    }
+    std::vector<int> Nodes() const {
+        std::vector<int> res;
+        for (auto &p : ring) if (std::find(res.begin(), res.end(), p.second) == res.end()) res.push_back(p.second);
+        std::sort(res.begin(), res.end());
+        return res;
+    }
+
+private:
+    std::map<uint64_t, int> ring;
+    size_t vnodes;
+};
+
+// Merkle tree over the catalogue (or the loans) of one LibraryManager. Records
+// are grouped into 2^Depth buckets by the top bits of hash64(ISBN), i.e. by
+// ranges of the same token space HashRing uses. A leaf is the sum of its
+// records' hashes (independent of vector order); inner nodes hash their two
+// children. Nodes are stored heap-style: 1 is the root, leaves are [Leaves, 2*Leaves).
+class MerkleTree {
+public:
+    static constexpr int Depth = 10;
+    static constexpr size_t Leaves = size_t(1) << Depth;
+
+    static size_t Bucket(const std::string &isbn) { return hash64(isbn) >> (64 - Depth); }
+
+    static MerkleTree OfBooks(const LibraryManager &m) {
+        MerkleTree t;
+        for (auto &b : m.Books) t.nodes[Leaves + Bucket(b.ISBN)] += hash64(b.to_json().dump());
+        t.Build();
+        return t;
+    }
+    static MerkleTree OfLoans(const LibraryManager &m) {
+        MerkleTree t;
+        for (auto &l : m.Loans) t.nodes[Leaves + Bucket(l.BookISBN)] += hash64(l.to_json().dump());
+        t.Build();
+        return t;
+    }
+
+    uint64_t Root() const { return nodes[1]; }
+    uint64_t Node(size_t i) const { return nodes[i]; }
+
+    // Walks down from the root, asking the other side only for the children of
+    // nodes that differ. `remote` returns the other tree's hashes for a list of
+    // node ids (one round trip per level). Returns the differing buckets.
+    std::vector<size_t> Diff(const std::function<std::vector<uint64_t>(const std::vector<size_t> &)> &remote,
+                             size_t *hashesExchanged = nullptr) const {
+        std::vector<size_t> level{1}, res;
+        while (!level.empty()) {
+            auto theirs = remote(level);
+            if (hashesExchanged) *hashesExchanged += level.size();
+            std::vector<size_t> next;
+            for (size_t i = 0; i < level.size(); ++i) {
+                if (theirs[i] == nodes[level[i]]) continue;
+                if (level[i] >= Leaves) res.push_back(level[i] - Leaves);
+                else { next.push_back(2 * level[i]); next.push_back(2 * level[i] + 1); }
+            }
+            level = std::move(next);
+        }
+        return res;
+    }
+    std::vector<size_t> Diff(const MerkleTree &other, size_t *hashesExchanged = nullptr) const {
+        return Diff([&](const std::vector<size_t> &ids){
+            std::vector<uint64_t> h;
+            for (size_t i : ids) h.push_back(other.nodes[i]);
+            return h;
+        }, hashesExchanged);
+    }
+
+private:
+    std::vector<uint64_t> nodes = std::vector<uint64_t>(2 * Leaves, 0);
+
+    void Build() {
+        for (size_t i = Leaves - 1; i >= 1; --i) nodes[i] = hash64(std::to_string(nodes[2 * i]) + ":" + std::to_string(nodes[2 * i + 1]));
+    }
+};
+
+struct SyncStats {
+    size_t HashesExchanged = 0;
+    size_t BucketsDiffering = 0;
+    size_t BooksTransferred = 0;
+};
+
+// Anti-entropy: makes `dst` match `src` by replacing only the buckets whose
+// book or loan hashes differ, with the books (and their loans) from `src`.
+static SyncStats SyncFrom(LibraryManager &dst, const LibraryManager &src) {
+    SyncStats st;
+    auto books = MerkleTree::OfBooks(dst).Diff(MerkleTree::OfBooks(src), &st.HashesExchanged);
+    auto loans = MerkleTree::OfLoans(dst).Diff(MerkleTree::OfLoans(src), &st.HashesExchanged);
+    std::unordered_set<size_t> buckets(books.begin(), books.end());
+    buckets.insert(loans.begin(), loans.end());
+    st.BucketsDiffering = buckets.size();
+    if (buckets.empty()) return st;
+
+    auto inDiff = [&](const std::string &isbn){ return buckets.count(MerkleTree::Bucket(isbn)) > 0; };
+    // through DropBooks, so indexes and dst's change feed see it; loans of
+    // books that only exist on the destination side go with them
+    std::unordered_set<std::string> stale;
+    for (auto &b : dst.Books) if (inDiff(b.ISBN)) stale.insert(b.ISBN);
+    for (auto &l : dst.Loans) if (inDiff(l.BookISBN)) stale.insert(l.BookISBN);
+    dst.DropBooks(stale);
+
+    std::unordered_map<std::string, json> items;
+    json order = json::array();
+    for (auto &b : src.Books) {
+        if (!inDiff(b.ISBN)) continue;
+        items[b.ISBN] = json{{"Book", b.to_json()}, {"Loans", json::array()}};
+        order.push_back(b.ISBN);
+    }
+    for (auto &l : src.Loans) {
+        auto it = items.find(l.BookISBN);
+        if (it != items.end()) it->second["Loans"].push_back(l.to_json());
+    }
+    json batch = json::array();
+    for (auto &isbn : order) batch.push_back(std::move(items[isbn]));
+    st.BooksTransferred = dst.ImportBooks(batch);
+    return st;
+}
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+// Lazily started coroutine producing a T; co_await it from another coroutine,
+// or block on it with SyncWait.
+template <class T>
+class Task {
+public:
+    struct promise_type {
+        std::optional<T> value;
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct Final {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                auto c = h.promise().continuation;
+                return c ? c : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        Final final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+
+    Task(Task &&o) noexcept : h(std::exchange(o.h, {})) {}
+    Task(const Task &) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) {
+        h.promise().continuation = c;
+        return h;
+    }
+    T await_resume() {
+        if (h.promise().error) std::rethrow_exception(h.promise().error);
+        return std::move(*h.promise().value);
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+namespace async_detail {
+// Fire-and-forget coroutine used to bridge into blocking code.
+struct Detached {
+    struct promise_type {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+template <class T>
+Detached Forward(Task<T> t, std::promise<T> &p) {
+    try { p.set_value(co_await t); } catch (...) { p.set_exception(std::current_exception()); }
+}
+} // namespace async_detail
+
+// Blocks the calling (non-pool) thread until the task finishes.
+template <class T>
+T SyncWait(Task<T> t) {
+    std::promise<T> p;
+    auto f = p.get_future();
+    async_detail::Forward(std::move(t), p);
+    return f.get();
+}
+
+// Admission classes, highest priority first: loans and returns, catalogue
+// and reader maintenance, then searches and reports.
+enum class OpClass { Circulation, Catalogue, Browse };
+constexpr size_t OpClassCount = 3;
+
+struct ClassLimits {
+    size_t MaxConcurrent = 0;             // 0 = only the global limit applies
+    size_t MaxQueue = 1024;               // arrivals beyond this are rejected at once
+    std::chrono::milliseconds MaxWait{0}; // queued longer than this is rejected; 0 = no deadline
+};
+
+struct AdmissionOptions {
+    size_t MaxInFlight = 0; // operations admitted at once, all classes; 0 = pool size
+    ClassLimits Classes[OpClassCount] = {
+        {0, 4096, std::chrono::milliseconds(0)},
+        {0, 1024, std::chrono::milliseconds(2000)},
+        {2, 256, std::chrono::milliseconds(500)},
+    };
+};
+
+struct AdmissionStats {
+    struct Class {
+        uint64_t Admitted = 0;
+        uint64_t Rejected = 0;   // queue full on arrival
+        uint64_t Expired = 0;    // waited past MaxWait
+        uint64_t WaitMicros = 0; // total queueing time of admitted operations
+        size_t Queued = 0;
+        size_t InFlight = 0;
+    };
+    Class Classes[OpClassCount];
+
+    json to_json() const {
+        static const char *names[OpClassCount] = {"Circulation", "Catalogue", "Browse"};
+        json j;
+        for (size_t i = 0; i < OpClassCount; ++i) {
+            auto &c = Classes[i];
+            j[names[i]] = {{"Admitted", c.Admitted}, {"Rejected", c.Rejected}, {"Expired", c.Expired},
+                           {"WaitMicros", c.WaitMicros}, {"Queued", c.Queued}, {"InFlight", c.InFlight}};
+        }
+        return j;
+    }
+};
+
+// Thrown by AsyncLibrary operations that admission control sheds.
+struct Overloaded : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Coroutine-based front end for a server: operations run on a few pool
+// threads, and a coroutine waiting for the library lock or for the journal
+// fsync is parked rather than blocking a thread. Mutations complete once
+// their change-log records are durable; concurrent mutations share a single
+// fsync (group commit).
+//
+// Every operation first passes admission control: it waits in the queue of
+// its OpClass until a slot is free, and free slots go to the highest-priority
+// class with work. A full queue or an expired deadline fails the operation
+// with Overloaded, so under overload searches are shed before loans slow down.
+// A timer thread expires queued operations at their deadline even while
+// nothing else arrives or finishes.
+class AsyncLibrary {
+public:
+    AsyncLibrary(LibraryManager &m, WorkStealingPool &p) : AsyncLibrary(m, p, AdmissionOptions()) {}
+    AsyncLibrary(LibraryManager &m, WorkStealingPool &p, AdmissionOptions opt) : mgr(m), pool(p), limits(opt) {
+        if (!limits.MaxInFlight) limits.MaxInFlight = pool.Size();
+        bool deadlines = false;
+        for (auto &c : limits.Classes) deadlines = deadlines || c.MaxWait.count();
+        if (deadlines) timer = std::thread([this]{ ExpireLoop(); });
+    }
+    AsyncLibrary(const AsyncLibrary &) = delete;
+    AsyncLibrary &operator=(const AsyncLibrary &) = delete;
+    ~AsyncLibrary() {
+        { std::lock_guard<std::mutex> g(admMu); closing = true; }
+        admCv.notify_one();
+        if (timer.joinable()) timer.join();
+    }
+
+    Task<bool> AddBook(Book b) { return Run<bool>(OpClass::Catalogue, [b](LibraryManager &m){ return m.AddBook(b); }, true); }
+    Task<bool> RemoveBook(std::string isbn) { return Run<bool>(OpClass::Catalogue, [isbn](LibraryManager &m){ return m.RemoveBook(isbn); }, true); }
+    Task<bool> AddReader(Reader r) { return Run<bool>(OpClass::Catalogue, [r](LibraryManager &m){ return m.AddReader(r); }, true); }
+    Task<bool> RemoveReader(int id) { return Run<bool>(OpClass::Catalogue, [id](LibraryManager &m){ return m.RemoveReader(id); }, true); }
+    Task<bool> IssueLoan(std::string isbn, int readerId) {
+        return Run<bool>(OpClass::Circulation, [isbn, readerId](LibraryManager &m){ return m.IssueLoan(isbn, readerId); }, true);
+    }
+    Task<bool> ReturnBook(std::string isbn, int readerId) {
+        return Run<bool>(OpClass::Circulation, [isbn, readerId](LibraryManager &m){ return m.ReturnBook(isbn, readerId); }, true);
+    }
+    Task<bool> TransferLoan(std::string isbn, int fromReader, int toReader) {
+        return Run<bool>(OpClass::Circulation, [isbn, fromReader, toReader](LibraryManager &m){ return m.TransferLoan(isbn, fromReader, toReader); }, true);
+    }
+
+    // Identical searches that arrive while one is running share its result
+    // (single flight), so a burst of the same query costs one scan.
+    Task<std::vector<Book>> SearchBooks(std::string term) { return CoalescedSearch(std::move(term)); }
+
+    // With a token the search runs on its own: a shared scan must not stop
+    // because one of its callers gave up.
+    Task<std::vector<Book>> SearchBooks(std::string term, CancelToken cancel) {
+        return Run<std::vector<Book>>(OpClass::Browse, [term, cancel](LibraryManager &m){ return m.SearchBooks(term, cancel); }, false);
+    }
+
+    // searches answered from another caller's scan, and scans actually run
+    uint64_t CoalescedSearches() const { return coalesced; }
+    uint64_t SearchScans() const { return scans; }
+    // group commit: fsync rounds, and the mutations they made durable
+    uint64_t SyncRounds() const { return syncRounds; }
+    uint64_t SyncedMutations() const { return synced; }
+
+    AdmissionStats Admission() {
+        std::lock_guard<std::mutex> g(admMu);
+        AdmissionStats st = admStats;
+        for (size_t i = 0; i < OpClassCount; ++i) {
+            st.Classes[i].Queued = queues[i].size();
+            st.Classes[i].InFlight = active[i];
+        }
+        return st;
+    }
+    Task<std::vector<Book>> AvailableBooks(CancelToken cancel = CancelToken()) {
+        return Run<std::vector<Book>>(OpClass::Browse, [cancel](LibraryManager &m){ return m.AvailableBooks(cancel); }, false);
+    }
+    Task<std::vector<Loan>> ActiveLoans(CancelToken cancel = CancelToken()) {
+        return Run<std::vector<Loan>>(OpClass::Browse, [cancel](LibraryManager &m){ return m.ActiveLoans(cancel); }, false);
+    }
+    Task<std::optional<int>> HolderAt(std::string isbn, std::string ts) {
+        return Run<std::optional<int>>(OpClass::Browse, [isbn, ts](LibraryManager &m){ return m.HolderAt(isbn, ts); }, false);
+    }
+
+private:
+    LibraryManager &mgr;
+    WorkStealingPool &pool;
+
+    // lock whose waiters are parked coroutines; Unlock hands it to the next one
+    std::mutex lockMu;
+    bool locked = false;
+    std::deque<std::coroutine_handle<>> lockWaiters;
+
+    // admission state: waiters per class, running operations per class
+    struct Waiter {
+        std::coroutine_handle<> h;
+        std::chrono::steady_clock::time_point since;
+        bool admitted = false;
+    };
+    AdmissionOptions limits;
+    std::mutex admMu;
+    std::deque<Waiter *> queues[OpClassCount];
+    size_t active[OpClassCount] = {};
+    size_t inFlight = 0;
+    AdmissionStats admStats;
+    std::condition_variable admCv; // a queue got a new front
+    bool closing = false;
+    std::thread timer;
+
+    // searches in progress by term, with the coroutines waiting for their result
+    struct Flight {
+        std::vector<std::coroutine_handle<>> waiters;
+        std::shared_ptr<const std::vector<Book>> result;
+        std::exception_ptr error;
+    };
+    std::mutex flightMu;
+    std::unordered_map<std::string, std::shared_ptr<Flight>> flights;
+    std::atomic<uint64_t> coalesced{0}, scans{0};
+
+    // coroutines waiting for the next change-log fsync
+    std::mutex syncMu;
+    bool syncing = false;
+    std::vector<std::coroutine_handle<>> syncWaiters;
+    std::atomic<uint64_t> syncRounds{0}, synced{0};
+
+    bool CanStart(size_t c) const {
+        return inFlight < limits.MaxInFlight &&
+               (!limits.Classes[c].MaxConcurrent || active[c] < limits.Classes[c].MaxConcurrent);
+    }
+    void Start(size_t c, Waiter &w, std::chrono::steady_clock::time_point now) {
+        ++active[c];
+        ++inFlight;
+        w.admitted = true;
+        ++admStats.Classes[c].Admitted;
+        admStats.Classes[c].WaitMicros += std::chrono::duration_cast<std::chrono::microseconds>(now - w.since).count();
+    }
+    // Hands free slots to queued waiters in priority order and fails the ones
+    // past their deadline. Queues are FIFO with one MaxWait per class, so only
+    // the fronts need checking. Caller holds admMu and resumes `wake`.
+    void Dispatch(std::chrono::steady_clock::time_point now, std::vector<std::coroutine_handle<>> &wake) {
+        for (size_t c = 0; c < OpClassCount; ++c) {
+            auto &q = queues[c];
+            auto maxWait = limits.Classes[c].MaxWait;
+            while (!q.empty()) {
+                Waiter *w = q.front();
+                if (maxWait.count() && now - w->since > maxWait) {
+                    q.pop_front();
+                    ++admStats.Classes[c].Expired;
+                    wake.push_back(w->h);
+                    continue;
+                }
+                if (!CanStart(c)) break;
+                q.pop_front();
+                Start(c, *w, now);
+                wake.push_back(w->h);
+            }
+        }
+    }
+    void Resume(const std::vector<std::coroutine_handle<>> &wake) {
+        for (auto h : wake) pool.Post([h]{ h.resume(); });
+    }
+    // Sleeps until the earliest queue front's deadline and expires it.
+    void ExpireLoop() {
+        std::unique_lock<std::mutex> g(admMu);
+        while (!closing) {
+            auto next = std::chrono::steady_clock::time_point::max();
+            for (size_t c = 0; c < OpClassCount; ++c)
+                if (!queues[c].empty() && limits.Classes[c].MaxWait.count())
+                    next = std::min(next, queues[c].front()->since + limits.Classes[c].MaxWait + std::chrono::microseconds(1));
+            if (next == std::chrono::steady_clock::time_point::max()) { admCv.wait(g); continue; }
+            if (admCv.wait_until(g, next) != std::cv_status::timeout) continue;
+            std::vector<std::coroutine_handle<>> wake;
+            Dispatch(std::chrono::steady_clock::now(), wake);
+            g.unlock();
+            Resume(wake);
+            g.lock();
+        }
+    }
+    struct Admit {
+        AsyncLibrary &lib;
+        OpClass cls;
+        Waiter w{};
+        bool rejected = false;
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            // once queued, this frame may be resumed and destroyed by another
+            // thread, so nothing below the lock may touch the awaiter
+            AsyncLibrary &l = lib;
+            size_t c = size_t(cls);
+            auto now = std::chrono::steady_clock::now();
+            std::vector<std::coroutine_handle<>> wake;
+            bool suspend = true;
+            {
+                std::lock_guard<std::mutex> g(l.admMu);
+                l.Dispatch(now, wake);
+                bool ahead = false; // equal or higher priority work already waiting
+                for (size_t i = 0; i <= c; ++i) ahead = ahead || !l.queues[i].empty();
+                w.h = h;
+                w.since = now;
+                if (!ahead && l.CanStart(c)) {
+                    l.Start(c, w, now);
+                    suspend = false;
+                } else if (l.queues[c].size() >= l.limits.Classes[c].MaxQueue) {
+                    ++l.admStats.Classes[c].Rejected;
+                    rejected = true;
+                    suspend = false;
+                } else {
+                    l.queues[c].push_back(&w);
+                    if (l.queues[c].size() == 1) l.admCv.notify_one();
+                }
+            }
+            l.Resume(wake);
+            return suspend;
+        }
+        void await_resume() {
+            if (w.admitted) return;
+            static const char *names[OpClassCount] = {"circulation", "catalogue", "browse"};
+            throw Overloaded(std::string(names[size_t(cls)]) + (rejected ? " queue full" : " deadline exceeded"));
+        }
+    };
+    void Release(OpClass cls) {
+        std::vector<std::coroutine_handle<>> wake;
+        {
+            std::lock_guard<std::mutex> g(admMu);
+            --active[size_t(cls)];
+            --inFlight;
+            Dispatch(std::chrono::steady_clock::now(), wake);
+        }
+        Resume(wake);
+    }
+
+    struct OnPool {
+        WorkStealingPool &pool;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) { pool.Post([h]{ h.resume(); }); }
+        void await_resume() {}
+    };
+    struct Lock {
+        AsyncLibrary &lib;
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> g(lib.lockMu);
+            if (!lib.locked) { lib.locked = true; return false; }
+            lib.lockWaiters.push_back(h);
+            return true;
+        }
+        void await_resume() {}
+    };
+    void Unlock() {
+        std::coroutine_handle<> next;
+        {
+            std::lock_guard<std::mutex> g(lockMu);
+            if (lockWaiters.empty()) { locked = false; return; }
+            next = lockWaiters.front();
+            lockWaiters.pop_front();
+        }
+        pool.Post([next]{ next.resume(); });
+    }
+    struct Durable {
+        AsyncLibrary &lib;
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            bool start;
+            {
+                std::lock_guard<std::mutex> g(lib.syncMu);
+                lib.syncWaiters.push_back(h);
+                start = !lib.syncing;
+                lib.syncing = true;
+            }
+            if (start) lib.pool.Post([l = &lib]{ l->SyncLoop(); });
+        }
+        void await_resume() {}
+    };
+    // one fsync per round covers every mutation that asked before it started
+    void SyncLoop() {
+        while (true) {
+            std::vector<std::coroutine_handle<>> batch;
+            {
+                std::lock_guard<std::mutex> g(syncMu);
+                if (syncWaiters.empty()) { syncing = false; return; }
+                batch.swap(syncWaiters);
+            }
+            mgr.SyncChangeLog();
+            ++syncRounds;
+            synced += batch.size();
+            for (auto h : batch) pool.Post([h]{ h.resume(); });
+        }
+    }
+
+    // Suspends if a search for the same term is running (resumed with its
+    // result); otherwise registers this caller as the one doing the search.
+    struct JoinFlight {
+        AsyncLibrary &lib;
+        const std::string &term;
+        std::shared_ptr<Flight> flight;
+        bool leader = false;
+        bool await_ready() { return false; }
+        bool await_suspend(std::coroutine_handle<> h) {
+            std::lock_guard<std::mutex> g(lib.flightMu);
+            auto it = lib.flights.find(term);
+            if (it == lib.flights.end()) {
+                flight = std::make_shared<Flight>();
+                lib.flights.emplace(term, flight);
+                leader = true;
+                return false;
+            }
+            flight = it->second;
+            flight->waiters.push_back(h);
+            ++lib.coalesced;
+            return true;
+        }
+        JoinFlight &await_resume() { return *this; }
+    };
+
+    Task<std::vector<Book>> CoalescedSearch(std::string term) {
+        JoinFlight join{*this, term, nullptr, false};
+        co_await join;
+        if (!join.leader) {
+            if (join.flight->error) std::rethrow_exception(join.flight->error);
+            co_return *join.flight->result;
+        }
+        std::vector<Book> res;
+        std::exception_ptr error;
+        ++scans;
+        auto scan = Run<std::vector<Book>>(OpClass::Browse, [term](LibraryManager &m){ return m.SearchBooks(term); }, false);
+        try {
+            res = co_await scan;
+        } catch (...) {
+            error = std::current_exception();
+        }
+        std::vector<std::coroutine_handle<>> waiters;
+        {
+            std::lock_guard<std::mutex> g(flightMu);
+            join.flight->result = std::make_shared<const std::vector<Book>>(res);
+            join.flight->error = error;
+            waiters.swap(join.flight->waiters);
+            flights.erase(term);
+        }
+        for (auto h : waiters) pool.Post([h]{ h.resume(); });
+        if (error) std::rethrow_exception(error);
+        co_return res;
+    }
+
+    // The admission slot is held until the library lock is released; the
+    // fsync wait of a mutation does not occupy it.
+    template <class R, class F>
+    Task<R> Run(OpClass cls, F f, bool durable) {
+        co_await Admit{*this, cls};
+        co_await OnPool{pool};
+        co_await Lock{*this};
+        std::optional<R> res;
+        try { res = f(mgr); } catch (...) { Unlock(); Release(cls); throw; }
+        Unlock();
+        Release(cls);
+        if (durable) co_await Durable{*this};
+        co_return std::move(*res);
+    }
+};
+
+// --async-bench <n> [window]: n readers borrow a book each through AsyncLibrary
+// on DefaultPool() while searches run, then half of them return it; clients
+// come in waves of `window` concurrent requests (a large window overloads the
+// admission queues). The final state is checked with CheckIntegrity and
+// against the successful calls, and the admission statistics are printed.
+static int RunAsyncBench(size_t n, const std::string &logPath, size_t window = 1000) {
+    LibraryManager m;
+    std::remove(logPath.c_str());
+    m.OpenChangeLog(logPath);
+    auto isbn = [](size_t i){ return "bench-" + std::to_string(i); };
+    for (size_t i = 0; i < n; ++i) {
+        m.AddBook(Book{"Bench " + std::to_string(i), "Bench", isbn(i)});
+        m.AddReader(Reader{int(i) + 1, "Bench", ""});
+    }
+    AsyncLibrary lib(m, DefaultPool());
+    size_t issued = 0, returned = 0, searched = 0, shed = 0;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t from = 0; from < n; from += window) {
+        size_t to = std::min(n, from + window);
+        std::vector<std::promise<std::vector<Book>>> searches(to - from);
+        std::vector<std::promise<bool>> issues(to - from);
+        for (size_t i = from; i < to; ++i) {
+            async_detail::Forward(lib.IssueLoan(isbn(i), int(i) + 1), issues[i - from]);
+            async_detail::Forward(lib.SearchBooks("bench " + std::to_string(i % 10)), searches[i - from]);
+        }
+        for (auto &p : searches) try { p.get_future().get(); ++searched; } catch (const Overloaded &) { ++shed; }
+        for (auto &p : issues) try { issued += p.get_future().get(); } catch (const Overloaded &) { ++shed; }
+    }
+    for (size_t from = 0; from < n; from += 2 * window) {
+        std::vector<std::promise<bool>> returns;
+        returns.reserve(window);
+        for (size_t i = from; i < std::min(n, from + 2 * window); i += 2) {
+            returns.emplace_back();
+            async_detail::Forward(lib.ReturnBook(isbn(i), int(i) + 1), returns.back());
+        }
+        for (auto &p : returns) try { returned += p.get_future().get(); } catch (const Overloaded &) { ++shed; }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    auto rep = m.CheckIntegrity(false);
+    size_t open = m.ActiveLoans().size();
+    bool ok = rep.Ok() && open == issued - returned;
+    std::cout << "Issued " << issued << ", returned " << returned << ", searched " << searched << ", shed " << shed
+              << " in " << secs << " s; " << open << " open loans, integrity " << (ok ? "ok" : "FAILED") << "\n"
+              << "Searches: " << lib.SearchScans() << " scans, " << lib.CoalescedSearches() << " coalesced; "
+              << "fsync: " << lib.SyncRounds() << " rounds for " << lib.SyncedMutations() << " mutations\n"
+              << "Admission: " << lib.Admission().to_json().dump(2) << "\n";
+    return ok ? 0 : 1;
+}
+#endif
+
+#ifndef _WIN32
+// Minimal JSON-over-UDP endpoint on 127.0.0.1, used by the cluster mode.
+class UdpSocket {
+public:
+    UdpSocket() = default;
+    UdpSocket(const UdpSocket &) = delete;
+    UdpSocket &operator=(const UdpSocket &) = delete;
+    ~UdpSocket() { if (fd >= 0) close(fd); }
+
+    // port 0 picks an ephemeral port
+    bool Bind(int port) {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (fd < 0) return false;
+        sockaddr_in a{};
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        a.sin_port = htons(port);
+        if (bind(fd, (sockaddr *)&a, sizeof(a)) < 0) return false;
+        int buf = 4 << 20;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+        return true;
+    }
+
+    void SendTo(int port, const json &msg) {
+        std::string s = msg.dump();
+        sockaddr_in a{};
+        a.sin_family = AF_INET;
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        a.sin_port = htons(port);
+        sendto(fd, s.data(), s.size(), 0, (sockaddr *)&a, sizeof(a));
+    }
+
+    bool Recv(json &msg, int &fromPort, int timeoutMs) {
+        pollfd p{fd, POLLIN, 0};
+        if (poll(&p, 1, timeoutMs) <= 0) return false;
+        static thread_local std::vector<char> buf(65536);
+        sockaddr_in a{};
+        socklen_t len = sizeof(a);
+        ssize_t n = recvfrom(fd, buf.data(), buf.size(), 0, (sockaddr *)&a, &len);
+        if (n <= 0) return false;
+        fromPort = ntohs(a.sin_port);
+        try { msg = json::parse(buf.begin(), buf.begin() + n); } catch (...) { return false; }
+        return true;
+    }
+
+private:
+    int fd = -1;
+};
+
+// Raft-replicated LibraryManager. Every mutation is a ChangeEvent in the Raft
+// log; a node applies committed entries in order with LibraryManager::Apply,
+// so all nodes end up with the same state. Clients talk to the leader, other
+// nodes answer with a redirect. The leader batches all client requests that
+// arrive together into one log write and pipelines AppendEntries (nextIndex
+// advances without waiting for the reply).
+class RaftNode {
+public:
+    RaftNode(int id, std::vector<int> ports)
+        : id(id), ports(std::move(ports)), rng(std::random_device{}() + id),
+          logPath("raft-" + std::to_string(id) + ".log"), statePath("raft-" + std::to_string(id) + ".state") {
+        std::ifstream sf(statePath);
+        if (sf) {
+            json j = json::parse(sf, nullptr, false); // replaced atomically, so only missing, never torn
+            if (j.is_object()) {
+                term = j.value("Term", uint64_t(0));
+                votedFor = j.value("VotedFor", -1);
+            }
+        }
+        // a node killed mid-append leaves a torn last line: never acknowledged,
+        // so it is cut off and the leader resends it
+        std::ifstream lf(logPath, std::ios::binary);
+        std::string line;
+        off_t good = 0;
+        while (std::getline(lf, line)) {
+            if (lf.eof()) break; // no newline: torn
+            json j = json::parse(line, nullptr, false);
+            if (j.is_discarded() || !j.contains("Cmd")) break;
+            log.push_back(Entry::from_json(j));
+            good += line.size() + 1;
+        }
+        lf.close();
+        struct stat st;
+        if (stat(logPath.c_str(), &st) == 0 && st.st_size > good && truncate(logPath.c_str(), good) == 0) SyncPath(logPath);
+    }
+
+    const LibraryManager &State() const { return state; }
+
+    bool Run(const std::atomic<bool> &stop) {
+        if (!sock.Bind(ports[id])) return false;
+        ResetElectionTimer();
+        while (!stop) {
+            json msg; int from = 0;
+            // drain everything that is queued, then act on it as one batch
+            for (int wait = 5; sock.Recv(msg, from, wait); wait = 0) Handle(msg, from);
+            FlushLog();
+            auto now = Clock::now();
+            if (role == Role::Leader) {
+                bool heartbeat = now >= nextHeartbeat;
+                SendAppends(heartbeat);
+                if (heartbeat) nextHeartbeat = now + std::chrono::milliseconds(50);
+                AdvanceCommit();
+            } else if (now >= electionDeadline) {
+                StartElection();
+            }
+            ApplyCommitted();
+        }
+        return true;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    enum class Role { Follower, Candidate, Leader };
+    // Client and Req identify the client request an entry came from (0 for
+    // the leader's own entries); Floor is the client's oldest unanswered request.
+    struct Entry {
+        uint64_t Term;
+        ChangeEvent Cmd;
+        uint64_t Client = 0, Req = 0, Floor = 0;
+
+        json to_json() const {
+            json j = {{"Term", Term}, {"Cmd", Cmd.to_json()}};
+            if (Client) { j["Client"] = Client; j["Req"] = Req; j["Floor"] = Floor; }
+            return j;
+        }
+        static Entry from_json(const json &j) {
+            return {j.value("Term", uint64_t(0)), ChangeEvent::from_json(j["Cmd"]),
+                    j.value("Client", uint64_t(0)), j.value("Req", uint64_t(0)), j.value("Floor", uint64_t(0))};
+        }
+    };
+    // Replies already given per client, rebuilt on every replica by applying
+    // the log: a retried request is answered from here instead of running twice.
+    struct Session {
+        uint64_t floor = 0;              // requests below it are answered and never retried
+        std::map<uint64_t, bool> replies; // request id -> ok
+    };
+    static constexpr size_t MaxBatch = 64;      // entries per AppendEntries datagram
+    static constexpr size_t MaxInFlight = 1024; // unacknowledged entries per follower
+
+    int id;
+    std::vector<int> ports;
+    UdpSocket sock;
+    LibraryManager state;
+    std::mt19937 rng;
+    std::string logPath, statePath;
+
+    // persistent
+    uint64_t term = 0;
+    int votedFor = -1;
+    std::vector<Entry> log; // log[i] has index i + 1
+    size_t persisted = SIZE_MAX; // entries [persisted, log.size()) are not on disk yet; SIZE_MAX = all are
+
+    // volatile
+    Role role = Role::Follower;
+    int leader = -1;
+    size_t votes = 0;
+    uint64_t commitIndex = 0, lastApplied = 0;
+    std::vector<uint64_t> nextIndex, matchIndex;
+    Clock::time_point electionDeadline, nextHeartbeat;
+    std::unordered_map<uint64_t, std::pair<int, json>> waiting; // log index -> (client port, request id)
+    std::unordered_map<uint64_t, Session> sessions;               // client id -> replies
+
+    uint64_t LastIndex() const { return log.size(); }
+    uint64_t TermAt(uint64_t idx) const { return idx == 0 || idx > log.size() ? 0 : log[idx - 1].Term; }
+    size_t Majority() const { return ports.size() / 2 + 1; }
+
+    void ResetElectionTimer() {
+        electionDeadline = Clock::now() + std::chrono::milliseconds(std::uniform_int_distribution<int>(300, 600)(rng));
+    }
+
+    // fsyncs a file, or with dir=true the directory holding it (for renames)
+    static void SyncPath(const std::string &path, bool dir = false) {
+        std::string p = path;
+        if (dir) p = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/'));
+        int fd = open(p.c_str(), dir ? O_RDONLY : O_WRONLY);
+        if (fd >= 0) { fsync(fd); close(fd); }
+    }
+
+    // Replaces a file so that a crash leaves either the old or the new contents.
+    static void ReplaceFile(const std::string &path, const std::string &data) {
+        std::string tmp = path + ".tmp";
+        std::ofstream(tmp, std::ios::trunc | std::ios::binary) << data;
+        SyncPath(tmp);
+        std::rename(tmp.c_str(), path.c_str());
+        SyncPath(path, true);
+    }
+
+    // Term and vote are on disk before any vote or append reply leaves.
+    void PersistState() {
+        ReplaceFile(statePath, json{{"Term", term}, {"VotedFor", votedFor}}.dump());
+    }
+
+    void Append(Entry e) {
+        if (persisted == SIZE_MAX) persisted = log.size();
+        e.Cmd.Seq = log.size() + 1;
+        log.push_back(std::move(e));
+    }
+
+    void FlushLog() {
+        if (persisted == SIZE_MAX) return;
+        std::string buf;
+        for (size_t i = persisted; i < log.size(); ++i) buf += log[i].to_json().dump() + "\n";
+        std::ofstream(logPath, std::ios::app | std::ios::binary) << buf;
+        SyncPath(logPath); // entries are acknowledged only once durable
+        persisted = SIZE_MAX;
+    }
+
+    void TruncateLog(uint64_t fromIdx) {
+        log.resize(fromIdx - 1);
+        std::string buf;
+        for (auto &e : log) buf += e.to_json().dump() + "\n";
+        ReplaceFile(logPath, buf);
+        persisted = SIZE_MAX;
+    }
+
+    void StepDown(uint64_t newTerm) {
+        if (newTerm > term) { term = newTerm; votedFor = -1; PersistState(); }
+        if (role == Role::Leader) waiting.clear(); // clients retry against the new leader
+        role = Role::Follower;
+    }
+
+    void StartElection() {
+        role = Role::Candidate;
+        ++term;
+        votedFor = id;
+        votes = 1;
+        leader = -1;
+        PersistState();
+        ResetElectionTimer();
+        if (votes >= Majority()) { BecomeLeader(); return; }
+        json req{{"type", "vote"}, {"term", term}, {"from", id}, {"lastIndex", LastIndex()}, {"lastTerm", TermAt(LastIndex())}};
+        for (size_t p = 0; p < ports.size(); ++p) if ((int)p != id) sock.SendTo(ports[p], req);
+    }
+
+    void BecomeLeader() {
+        role = Role::Leader;
+        leader = id;
+        nextIndex.assign(ports.size(), LastIndex() + 1);
+        matchIndex.assign(ports.size(), 0);
+        // a no-op from the new term lets earlier entries commit
+        ChangeEvent noop;
+        noop.Op = "Noop";
+        noop.Time = now_iso();
+        Append({term, noop});
+        FlushLog();
+        nextHeartbeat = Clock::now();
+    }
+
+    void SendAppends(bool heartbeat) {
+        for (size_t p = 0; p < ports.size(); ++p) {
+            if ((int)p == id) continue;
+            // pipelined: keep sending from nextIndex while earlier batches are in flight
+            do {
+                uint64_t prev = nextIndex[p] - 1;
+                json entries = json::array();
+                for (uint64_t i = nextIndex[p]; i <= LastIndex() && entries.size() < MaxBatch; ++i)
+                    entries.push_back(log[i - 1].to_json());
+                if (entries.empty() && !heartbeat) break;
+                nextIndex[p] += entries.size();
+                sock.SendTo(ports[p], json{{"type", "append"}, {"term", term}, {"from", id}, {"prevIndex", prev},
+                                           {"prevTerm", TermAt(prev)}, {"entries", entries}, {"commit", commitIndex}});
+                heartbeat = false;
+            } while (nextIndex[p] <= LastIndex() && nextIndex[p] - matchIndex[p] <= MaxInFlight);
+        }
+    }
+
+    void AdvanceCommit() {
+        for (uint64_t n = LastIndex(); n > commitIndex && TermAt(n) == term; --n) {
+            size_t count = 1;
+            for (size_t p = 0; p < ports.size(); ++p) if ((int)p != id && matchIndex[p] >= n) ++count;
+            if (count >= Majority()) { commitIndex = n; break; }
+        }
+    }
+
+    void ApplyCommitted() {
+        while (lastApplied < commitIndex) {
+            ++lastApplied;
+            const Entry &en = log[lastApplied - 1];
+            bool ok = false;
+            if (!en.Client) {
+                ok = state.Apply(en.Cmd);
+            } else {
+                // a retry can reach the log twice (e.g. once per leader): only the first copy runs
+                Session &s = sessions[en.Client];
+                auto done = s.replies.find(en.Req);
+                if (done != s.replies.end()) ok = done->second;
+                else if (en.Req >= s.floor) ok = s.replies[en.Req] = state.Apply(en.Cmd);
+                s.floor = std::max(s.floor, en.Floor);
+                s.replies.erase(s.replies.begin(), s.replies.lower_bound(s.floor));
+            }
+            auto w = waiting.find(lastApplied);
+            if (w != waiting.end()) {
+                sock.SendTo(w->second.first, json{{"type", "reply"}, {"id", w->second.second}, {"ok", ok}});
+                waiting.erase(w);
+            }
+        }
+    }
+
+    void Handle(const json &m, int from) {
+        std::string type = m.value("type", "");
+        if (type == "client") { HandleClient(m, from); return; }
+        uint64_t t = m.value("term", uint64_t(0));
+        if (t > term) StepDown(t);
+        int peer = m.value("from", -1);
+        if (peer < 0 || peer >= (int)ports.size()) return;
+
+        if (type == "vote") {
+            bool upToDate = m.value("lastTerm", uint64_t(0)) > TermAt(LastIndex()) ||
+                            (m.value("lastTerm", uint64_t(0)) == TermAt(LastIndex()) && m.value("lastIndex", uint64_t(0)) >= LastIndex());
+            bool grant = t == term && (votedFor == -1 || votedFor == peer) && upToDate;
+            if (grant) { votedFor = peer; PersistState(); ResetElectionTimer(); }
+            sock.SendTo(ports[peer], json{{"type", "vote_reply"}, {"term", term}, {"from", id}, {"granted", grant}});
+        } else if (type == "vote_reply") {
+            if (role == Role::Candidate && t == term && m.value("granted", false) && ++votes >= Majority()) BecomeLeader();
+        } else if (type == "append") {
+            HandleAppend(m, t, peer);
+        } else if (type == "append_reply") {
+            if (role != Role::Leader || t != term) return;
+            uint64_t match = m.value("match", uint64_t(0));
+            if (m.value("ok", false)) {
+                matchIndex[peer] = std::max(matchIndex[peer], match);
+                nextIndex[peer] = std::max(nextIndex[peer], match + 1);
+            } else {
+                // follower is missing entries: resend from where it says it matches
+                nextIndex[peer] = std::min(nextIndex[peer], match + 1);
+            }
+        }
+    }
+
+    void HandleAppend(const json &m, uint64_t t, int peer) {
+        auto reply = [&](bool ok, uint64_t match) {
+            sock.SendTo(ports[peer], json{{"type", "append_reply"}, {"term", term}, {"from", id}, {"ok", ok}, {"match", match}});
+        };
+        if (t < term) { reply(false, 0); return; }
+        role = Role::Follower;
+        leader = peer;
+        ResetElectionTimer();
+        uint64_t prev = m.value("prevIndex", uint64_t(0));
+        if (prev > LastIndex() || TermAt(prev) != m.value("prevTerm", uint64_t(0))) {
+            reply(false, std::min(LastIndex(), prev ? prev - 1 : 0));
+            return;
+        }
+        uint64_t idx = prev;
+        for (auto &je : m["entries"]) {
+            ++idx;
+            uint64_t et = je.value("Term", uint64_t(0));
+            if (idx <= LastIndex()) {
+                if (TermAt(idx) == et) continue;
+                TruncateLog(idx);
+            }
+            Append(Entry::from_json(je));
+        }
+        FlushLog();
+        uint64_t commit = std::min(m.value("commit", uint64_t(0)), idx);
+        if (commit > commitIndex) commitIndex = commit;
+        reply(true, idx);
+    }
+
+    void HandleClient(const json &m, int from) {
+        if (role != Role::Leader) {
+            sock.SendTo(from, json{{"type", "reply"}, {"id", m["id"]}, {"ok", false}, {"redirect", leader >= 0 ? ports[leader] : -1}});
+            return;
+        }
+        ChangeEvent e;
+        e.Op = m.value("op", "");
+        if (e.Op == "SearchBooks") {
+            // served from the leader's applied state
+            json res = json::array();
+            for (auto &b : state.SearchBooks(m["data"].value("Term", ""))) res.push_back(json{{"Book", b.to_json()}, {"IsAvailable", b.IsAvailable}});
+            sock.SendTo(from, json{{"type", "reply"}, {"id", m["id"]}, {"ok", true}, {"result", res}});
+            return;
+        }
+        uint64_t client = m.value("client", uint64_t(0)), req = m.value("id", uint64_t(0));
+        // a retry of a request that was already applied gets the same answer again
+        auto s = sessions.find(client);
+        if (client && s != sessions.end()) {
+            auto done = s->second.replies.find(req);
+            if (done != s->second.replies.end()) {
+                sock.SendTo(from, json{{"type", "reply"}, {"id", m["id"]}, {"ok", done->second}});
+                return;
+            }
+        }
+        e.Time = now_iso();
+        e.Data = m.value("data", json::object());
+        // the leader fixes timestamps so every replica applies the same values
+        if (e.Op == "IssueLoan" && !e.Data.contains("LoanDate")) e.Data["LoanDate"] = e.Time;
+        if (e.Op == "ReturnBook" && !e.Data.contains("ReturnDate")) e.Data["ReturnDate"] = e.Time;
+        if (e.Op == "AddBook" && e.Data.value("Added", "").empty()) e.Data["Added"] = e.Time;
+        if (e.Op == "AddReader" && e.Data.value("Registered", "").empty()) e.Data["Registered"] = e.Time;
+        Append({term, std::move(e), client, req, m.value("floor", uint64_t(0))});
+        waiting[LastIndex()] = {from, m["id"]};
+    }
+};
+
+// Client side of the cluster: sends requests to the leader (following
+// redirects) and keeps up to `window` of them in flight. A resent request
+// keeps its id, so the cluster can tell a retry from a new request.
+class RaftClient {
+public:
+    explicit RaftClient(std::vector<int> ports) : ports(std::move(ports)) {
+        sock.Bind(0);
+        std::random_device rd;
+        client = (uint64_t(rd()) << 32 | rd()) | 1; // never 0, which means "no client"
+    }
+
+    // Runs a query on the leader; nullopt if no leader answered.
+    std::optional<json> Query(const std::string &op, const json &data) {
+        for (int attempt = 0; attempt < 20; ++attempt) {
+            uint64_t rid = nextId++;
+            sock.SendTo(ports[leaderHint], json{{"type", "client"}, {"id", rid}, {"op", op}, {"data", data}});
+            json msg; int from = 0;
+            while (sock.Recv(msg, from, 500) && msg.value("id", uint64_t(0)) != rid) {}
+            if (msg.value("id", uint64_t(0)) == rid && !msg.contains("redirect")) return msg.value("result", json());
+            leaderHint = (leaderHint + 1) % ports.size();
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        return std::nullopt;
+    }
+
+    // Returns the number of requests the cluster applied successfully.
+    size_t Submit(const std::vector<std::pair<std::string, json>> &reqs, size_t window = 256) {
+        using Clock = std::chrono::steady_clock;
+        struct Pending { size_t req; Clock::time_point sent; };
+        std::unordered_map<uint64_t, Pending> inFlight;
+        size_t next = 0, done = 0, applied = 0;
+        // request r has id first + r; ids below first + oldest are all answered
+        uint64_t first = nextId;
+        nextId += reqs.size();
+        std::vector<bool> answered(reqs.size(), false);
+        size_t oldest = 0;
+        auto send = [&](size_t r) {
+            uint64_t rid = first + r;
+            inFlight[rid] = {r, Clock::now()};
+            sock.SendTo(ports[leaderHint], json{{"type", "client"}, {"client", client}, {"id", rid}, {"floor", first + oldest},
+                                                {"op", reqs[r].first}, {"data", reqs[r].second}});
+        };
+        while (done < reqs.size()) {
+            while (next < reqs.size() && inFlight.size() < window) send(next++);
+            json msg; int from = 0;
+            if (sock.Recv(msg, from, 20)) {
+                auto it = inFlight.find(msg.value("id", uint64_t(0)));
+                if (it == inFlight.end()) continue;
+                size_t r = it->second.req;
+                inFlight.erase(it);
+                int redirect = msg.value("redirect", 0);
+                if (msg.contains("redirect")) {
+                    auto p = std::find(ports.begin(), ports.end(), redirect);
+                    leaderHint = p != ports.end() ? p - ports.begin() : (leaderHint + 1) % ports.size();
+                    if (redirect < 0) std::this_thread::sleep_for(std::chrono::milliseconds(50)); // election in progress
+                    send(r);
+                    continue;
+                }
+                ++done;
+                if (msg.value("ok", false)) ++applied;
+                answered[r] = true;
+                while (oldest < reqs.size() && answered[oldest]) ++oldest;
+            }
+            // lost datagram or dead leader: resend to the next node
+            auto now = Clock::now();
+            std::vector<size_t> retry;
+            for (auto it = inFlight.begin(); it != inFlight.end();) {
+                if (now - it->second.sent > std::chrono::milliseconds(1000)) { retry.push_back(it->second.req); it = inFlight.erase(it); }
+                else ++it;
+            }
+            if (!retry.empty()) leaderHint = (leaderHint + 1) % ports.size();
+            for (size_t r : retry) send(r);
+        }
+        return applied;
+    }
+
+private:
+    std::vector<int> ports;
+    UdpSocket sock;
+    size_t leaderHint = 0;
+    uint64_t client = 0;
+    uint64_t nextId = 1;
+};
+
+// One shard of a sharded deployment: a LibraryManager holding the books the
+// ring assigns to this port (plus a copy of all readers), served over UDP.
+class ShardWorker {
+public:
+    explicit ShardWorker(int port)
+        : port(port), prefix("shard-" + std::to_string(port) + "-") {
+        loaded = mgr.Load(prefix + "books.json", prefix + "readers.json", prefix + "loans.json");
+    }
+
+    // False if the shard's files do not parse or the port is taken.
+    bool Run(const std::atomic<bool> &stop) {
+        if (!loaded || !sock.Bind(port)) return false;
+        while (!stop) {
+            json req; int from = 0;
+            if (!sock.Recv(req, from, 100)) continue;
+            json res = Handle(req);
+            res["id"] = req["id"];
+            sock.SendTo(from, res);
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t MaxPayload = 32000; // JSON bytes per reply, well inside one datagram
+    static constexpr size_t MaxReplies = 4096;  // cached mutation replies, oldest dropped first
+
+    int port;
+    std::string prefix;
+    UdpSocket sock;
+    LibraryManager mgr;
+    bool loaded = false;
+    // replies to recent mutations by "client/id", so a retry is not applied twice
+    std::unordered_map<std::string, json> replies;
+    std::deque<std::string> replyOrder;
+
+    json Handle(const json &req) {
+        std::string op = req.value("op", "");
+        const json data = req.value("data", json::object());
+        if (op == "FindBook") {
+            auto b = mgr.GetBook(data.value("ISBN", ""));
+            if (!b) return json{{"ok", false}};
+            return json{{"ok", true}, {"Book", b->to_json()}, {"IsAvailable", b->IsAvailable}};
+        }
+        if (op == "SearchBooks") {
+            json res = json::array();
+            size_t limit = data.value("Limit", size_t(100));
+            // past the router's wait nobody reads the reply, so stop scanning
+            CancelToken cancel = CancelToken::After(std::chrono::milliseconds(data.value("TimeoutMs", 1000)));
+            for (auto &b : mgr.SearchBooks(data.value("Term", ""), cancel)) {
+                if (res.size() >= limit) break;
+                res.push_back(json{{"Book", b.to_json()}, {"IsAvailable", b.IsAvailable}});
+            }
+            return json{{"ok", true}, {"result", res}};
+        }
+        // Migration is two-phase: Extract only reads (a datagram's worth of)
+        // books this shard no longer owns, so a retried request gets the same
+        // batch; they are deleted by Release once the new owner has them.
+        if (op == "Extract") {
+            HashRing ring;
+            for (int p : data["Ring"]) ring.Add(p);
+            json items = mgr.CollectBooks([&](const Book &b){ return ring.Owner(b.ISBN) != port; }, MaxPayload);
+            return json{{"ok", true}, {"items", items}};
+        }
+        if (op == "BookLoans") return json{{"ok", true}, {"items", mgr.BookLoans(data.value("ISBN", ""), data.value("Offset", size_t(0)), MaxPayload)}};
+        if (op == "Release") {
+            mgr.DropBooks(std::unordered_set<std::string>(data["ISBNs"].begin(), data["ISBNs"].end()));
+            return json{{"ok", true}};
+        }
+        if (op == "Import") return json{{"ok", true}, {"count", mgr.ImportBooks(data["items"])}};
+        if (op == "ImportLoans") return json{{"ok", mgr.ImportLoans(data.value("ISBN", ""), data.value("Offset", size_t(0)), data["Loans"])}};
+        if (op == "ExportReaders") {
+            json res = json::array();
+            size_t from = data.value("Offset", size_t(0));
+            for (size_t i = from; i < mgr.Readers.size() && i < from + 300; ++i) res.push_back(mgr.Readers[i].to_json());
+            return json{{"ok", true}, {"items", res}};
+        }
+        if (op == "Count") return json{{"ok", true}, {"count", mgr.Books.size()}};
+        if (op == "Save") return json{{"ok", mgr.Save(prefix + "books.json", prefix + "readers.json", prefix + "loans.json")}};
+        ChangeEvent e;
+        e.Op = op;
+        e.Data = data;
+        e.Time = now_iso();
+        if (op == "IssueLoan" && !e.Data.contains("LoanDate")) e.Data["LoanDate"] = e.Time;
+        if (op == "ReturnBook" && !e.Data.contains("ReturnDate")) e.Data["ReturnDate"] = e.Time;
+        if (op == "AddBook" && e.Data.value("Added", "").empty()) e.Data["Added"] = e.Time;
+        if (op == "AddReader" && e.Data.value("Registered", "").empty()) e.Data["Registered"] = e.Time;
+        if (!req.contains("client")) return json{{"ok", mgr.Apply(e)}};
+        std::string key = req["client"].dump() + "/" + req["id"].dump();
+        auto it = replies.find(key);
+        if (it != replies.end()) return it->second;
+        json res{{"ok", mgr.Apply(e)}};
+        replies.emplace(key, res);
+        replyOrder.push_back(key);
+        if (replyOrder.size() > MaxReplies) { replies.erase(replyOrder.front()); replyOrder.pop_front(); }
+        return res;
+    }
+};
+
+// Front end of a sharded deployment. Book operations go to the shard that
+// owns the ISBN, searches are scattered to all shards and gathered, reader
+// changes are broadcast (every shard needs them to validate loans).
+class ShardRouter {
+public:
+    explicit ShardRouter(const std::vector<int> &ports) {
+        sock.Bind(0);
+        for (int p : ports) ring.Add(p);
+        std::random_device rd;
+        client = uint64_t(rd()) << 32 | rd();
+    }
+
+    bool AddBook(const Book &b) { return CallOk(ring.Owner(b.ISBN), "AddBook", b.to_json()); }
+    bool RemoveBook(const std::string &isbn) { return CallOk(ring.Owner(isbn), "RemoveBook", json{{"ISBN", isbn}}); }
+    bool IssueLoan(const std::string &isbn, int readerId) {
+        return CallOk(ring.Owner(isbn), "IssueLoan", json{{"BookISBN", isbn}, {"ReaderId", readerId}});
+    }
+    bool ReturnBook(const std::string &isbn, int readerId) {
+        return CallOk(ring.Owner(isbn), "ReturnBook", json{{"BookISBN", isbn}, {"ReaderId", readerId}});
+    }
+    std::optional<Book> FindBook(const std::string &isbn) {
+        auto r = Call(ring.Owner(isbn), "FindBook", json{{"ISBN", isbn}});
+        if (!r || !r->value("ok", false)) return std::nullopt;
+        return ParseHit((*r));
+    }
+
+    bool AddReader(const Reader &in) {
+        // every shard keeps a copy, so they must all get the same date
+        Reader r = in;
+        if (r.Registered.empty()) r.Registered = now_iso();
+        bool ok = true;
+        for (auto &res : CallAll("AddReader", r.to_json())) ok = ok && res && res->value("ok", false);
+        return ok;
+    }
+    bool RemoveReader(int id) {
+        bool ok = true;
+        for (auto &res : CallAll("RemoveReader", json{{"Id", id}})) ok = ok && res && res->value("ok", false);
+        return ok;
+    }
+
+    std::vector<Book> SearchBooks(const std::string &term, size_t limitPerShard = 100) {
+        std::vector<Book> res;
+        for (auto &r : CallAll("SearchBooks", json{{"Term", term}, {"Limit", limitPerShard}, {"TimeoutMs", 1000}})) {
+            if (!r) continue;
+            for (auto &h : (*r)["result"]) res.push_back(ParseHit(h));
+        }
+        return res;
+    }
+
+    size_t CountBooks() {
+        size_t n = 0;
+        for (auto &r : CallAll("Count", json::object())) if (r) n += r->value("count", size_t(0));
+        return n;
+    }
+
+    void SaveAll() { CallAll("Save", json::object()); }
+
+    // Adds a shard and moves only the books it now owns; returns the number moved.
+    size_t AddShard(int port) {
+        auto nodes = ring.Nodes();
+        if (nodes.empty()) { ring.Add(port); return 0; }
+        // the new shard needs the readers first
+        for (size_t off = 0;; off += 300) {
+            auto r = Call(nodes[0], "ExportReaders", json{{"Offset", off}});
+            if (!r || (*r)["items"].empty()) break;
+            for (auto &rd : (*r)["items"]) Call(port, "AddReader", rd);
+        }
+        ring.Add(port);
+        return Migrate(nodes);
     }
-    static Book from_json(const json &j) {
-        Book b;
-        b.Title = j.value("Title", "");
-        b.Author = j.value("Author", "");
-        b.ISBN = j.value("ISBN", "");
-        b.IsAvailable = j.value("IsAvailable", true);
-        return b;
+
+    // Drains a shard into the remaining ones; returns the number of books moved.
+    size_t RemoveShard(int port) {
+        ring.Remove(port);
+        return Migrate({port});
     }
-};
 
-struct Reader {
-    int Id = 0;
-    std::string Name;
-    std::string Email;
+private:
+    UdpSocket sock;
+    HashRing ring;
+    uint64_t client = 0; // tells shards which router a request id belongs to
+    uint64_t nextId = 1;
 
-    json to_json() const {
-        return json{{"Id", Id}, {"Name", Name}, {"Email", Email}};
+    static Book ParseHit(const json &h) {
+        Book b = Book::from_json(h["Book"]);
+        b.IsAvailable = h.value("IsAvailable", true);
+        return b;
     }
-    static Reader from_json(const json &j) {
-        Reader r;
-        r.Id = j.value("Id", 0);
-        r.Name = j.value("Name", "");
-        r.Email = j.value("Email", "");
-        return r;
+
+    // Copies each batch to its new owners and only then releases it on the
+    // source. Imports are idempotent, so after a failure the books are on the
+    // source (and maybe also the destination) and a later run completes them.
+    size_t Migrate(const std::vector<int> &sources) {
+        json ringPorts = ring.Nodes();
+        size_t moved = 0;
+        for (int src : sources) {
+            while (true) {
+                auto r = Call(src, "Extract", json{{"Ring", ringPorts}});
+                if (!r || (*r)["items"].empty()) break;
+                std::map<int, json> byOwner;
+                json isbns = json::array();
+                for (auto &item : (*r)["items"]) {
+                    int owner = ring.Owner(item["Book"].value("ISBN", ""));
+                    if (!byOwner.count(owner)) byOwner[owner] = json::array();
+                    byOwner[owner].push_back(item);
+                    isbns.push_back(item["Book"].value("ISBN", ""));
+                }
+                bool ok = true;
+                for (auto &g : byOwner) {
+                    ok = ok && CallOk(g.first, "Import", json{{"items", g.second}});
+                    // histories too big for one datagram follow page by page
+                    for (auto &item : g.second) {
+                        std::string isbn = item["Book"].value("ISBN", "");
+                        for (size_t off = 0, n = item.value("LoanCount", size_t(0)); ok && off < n;) {
+                            auto page = Call(src, "BookLoans", json{{"ISBN", isbn}, {"Offset", off}});
+                            ok = page && !(*page)["items"].empty() &&
+                                 CallOk(g.first, "ImportLoans", json{{"ISBN", isbn}, {"Offset", off}, {"Loans", (*page)["items"]}});
+                            if (ok) off += (*page)["items"].size();
+                        }
+                    }
+                }
+                if (!ok || !CallOk(src, "Release", json{{"ISBNs", isbns}})) break;
+                moved += isbns.size();
+            }
+        }
+        return moved;
     }
-};
 
-struct Loan {
-    std::string BookISBN;
-    int ReaderId = 0;
-    std::string LoanDate; // ISO string
-    std::optional<std::string> ReturnDate;
+    bool CallOk(int port, const std::string &op, const json &data) {
+        auto r = Call(port, op, data);
+        return r && r->value("ok", false);
+    }
 
-    json to_json() const {
-        json j = {{"BookISBN", BookISBN}, {"ReaderId", ReaderId}, {"LoanDate", LoanDate}};
-        if (ReturnDate) j["ReturnDate"] = *ReturnDate;
-        else j["ReturnDate"] = nullptr;
-        return j;
+    std::optional<json> Call(int port, const std::string &op, const json &data) {
+        if (port < 0) return std::nullopt;
+        // every attempt carries the same id: the shard answers a retried
+        // mutation from its reply cache instead of applying it again
+        uint64_t rid = nextId++;
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            sock.SendTo(port, json{{"client", client}, {"id", rid}, {"op", op}, {"data", data}});
+            json msg; int from = 0;
+            while (sock.Recv(msg, from, 1000)) if (msg.value("id", uint64_t(0)) == rid) return msg;
+        }
+        return std::nullopt;
     }
-    static Loan from_json(const json &j) {
-        Loan l;
-        l.BookISBN = j.value("BookISBN", "");
-        l.ReaderId = j.value("ReaderId", 0);
-        l.LoanDate = j.value("LoanDate", "");
-        if (!j["ReturnDate"].is_null()) l.ReturnDate = j.value("ReturnDate", "");
-        return l;
+
+    // Sends to every shard at once and gathers the replies (nullopt on timeout).
+    std::vector<std::optional<json>> CallAll(const std::string &op, const json &data) {
+        auto nodes = ring.Nodes();
+        std::unordered_map<uint64_t, size_t> slot;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            uint64_t rid = nextId++;
+            slot[rid] = i;
+            sock.SendTo(nodes[i], json{{"client", client}, {"id", rid}, {"op", op}, {"data", data}});
+        }
+        std::vector<std::optional<json>> res(nodes.size());
+        size_t pending = nodes.size();
+        json msg; int from = 0;
+        while (pending && sock.Recv(msg, from, 1000)) {
+            auto it = slot.find(msg.value("id", uint64_t(0)));
+            if (it == slot.end() || res[it->second]) continue;
+            res[it->second] = msg;
+            --pending;
+        }
+        return res;
     }
 };
+// LibraryManager data in a shared, file-backed mmap region, so several desk
+// processes on one machine work on one live dataset. Everything inside the
+// region is addressed by offsets from its base (each process maps it at a
+// different address), records have fixed-size fields, and a robust
+// process-shared mutex in the header serializes access. Capacities are fixed
+// when the region is created.
+class SharedLibrary {
+public:
+    struct Capacity { uint32_t Books = 100000, Readers = 50000, Loans = 500000; };
 
-static std::string now_iso() {
-    std::time_t t = std::time(nullptr);
-    char buf[64];
-    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&t));
-    return std::string(buf);
-}
+    SharedLibrary() = default;
+    SharedLibrary(const SharedLibrary &) = delete;
+    SharedLibrary &operator=(const SharedLibrary &) = delete;
+    ~SharedLibrary() { if (base) munmap(base, size); }
 
-class LibraryManager {
-public:
-    std::vector<Book> Books;
-    std::vector<Reader> Readers;
-    std::vector<Loan> Loans;
+    // Maps `path`, creating and initializing it if it does not exist yet.
+    // `created` tells the caller whether to seed it (see Import).
+    bool Open(const std::string &path, bool &created) { return Open(path, created, Capacity()); }
+    bool Open(const std::string &path, bool &created, Capacity cap) {
+        created = false;
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            created = true;
+            size = Layout(cap).total;
+            if (ftruncate(fd, size) != 0) { close(fd); return false; }
+        } else {
+            fd = open(path.c_str(), O_RDWR);
+            if (fd < 0) return false;
+            struct stat st;
+            // the creator may still be sizing the file
+            for (int i = 0; i < 100 && (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)); ++i)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            size = st.st_size;
+        }
+        void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) return false;
+        base = static_cast<char *>(p);
+        if (created) Init(cap);
+        else for (int i = 0; i < 100 && H().ready.load() != Magic; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return H().ready.load() == Magic;
+    }
 
-    bool AddBook(const Book &b) {
-        if (FindBook(b.ISBN)) return false;
-        Books.push_back(b);
-        return true;
+    // Seeds a freshly created region from a loaded LibraryManager. Names and
+    // titles longer than their slot are shortened rather than dropped.
+    void Import(const LibraryManager &m) {
+        Guard g(*this);
+        for (Reader r : m.Readers) {
+            r.Name = Clip(r.Name, sizeof(SReader::name) - 1);
+            r.Email = Clip(r.Email, sizeof(SReader::email) - 1);
+            AddReaderLocked(r);
+        }
+        for (Book b : m.Books) {
+            b.Title = Clip(b.Title, sizeof(SBook::title) - 1);
+            b.Author = Clip(b.Author, sizeof(SBook::author) - 1);
+            AddBookLocked(b);
+        }
+        for (auto &l : m.Loans) {
+            if (H().nLoans >= H().capLoans) break;
+            SLoan &s = LoanAt(H().nLoans);
+            ToLoan(l, s);
+            if (!l.ReturnDate) if (int32_t bi = FindBookLocked(l.BookISBN); bi >= 0) BookAt(bi).openLoan = H().nLoans;
+            ++H().nLoans;
+        }
     }
 
+    // Writes the current state in the usual JSON files.
+    bool Save(const std::string &booksFile, const std::string &readersFile, const std::string &loansFile) const {
+        LibraryManager m;
+        {
+            Guard g(*this);
+            for (uint32_t i = 0; i < H().nReaders; ++i) m.Readers.push_back({ReaderAt(i).id, ReaderAt(i).name, ReaderAt(i).email, ReaderAt(i).registered});
+            for (uint32_t i = 0; i < H().nBooks; ++i) m.Books.push_back(ToBook(BookAt(i)));
+            for (uint32_t i = 0; i < H().nLoans; ++i) m.Loans.push_back(FromLoan(LoanAt(i)));
+        }
+        return m.Save(booksFile, readersFile, loansFile);
+    }
+
+    bool AddBook(const Book &b) { Guard g(*this); return AddBookLocked(b); }
+
     bool RemoveBook(const std::string &isbn) {
-        auto it = std::find_if(Books.begin(), Books.end(), [&](const Book &x){ return x.ISBN == isbn; });
-        if (it == Books.end()) return false;
-        // only remove if available
-        if (!it->IsAvailable) return false;
-        Books.erase(it);
+        Guard g(*this);
+        int32_t i = FindBookLocked(isbn);
+        if (i < 0 || BookAt(i).openLoan >= 0) return false;
+        IndexSlot(isbn) = Tomb;
+        uint32_t last = --H().nBooks;
+        if ((uint32_t)i != last) {
+            BookAt(i) = BookAt(last);
+            IndexSlot(BookAt(i).isbn) = i;
+        }
         return true;
     }
 
     int NextReaderId() const {
+        Guard g(*this);
         int maxId = 0;
-        for (auto &r : Readers) if (r.Id > maxId) maxId = r.Id;
+        for (uint32_t i = 0; i < H().nReaders; ++i) maxId = std::max(maxId, (int)ReaderAt(i).id);
         return maxId + 1;
     }
 
-    bool AddReader(const Reader &r) {
-        if (std::any_of(Readers.begin(), Readers.end(), [&](const Reader &x){ return x.Id == r.Id; })) return false;
-        Readers.push_back(r);
-        return true;
-    }
+    bool AddReader(const Reader &r) { Guard g(*this); return AddReaderLocked(r); }
 
     bool RemoveReader(int id) {
-        auto it = std::find_if(Readers.begin(), Readers.end(), [&](const Reader &x){ return x.Id == id; });
-        if (it == Readers.end()) return false;
-        // remove active loans
-        for (auto lit = Loans.begin(); lit != Loans.end();) {
-            if (lit->ReaderId == id && !lit->ReturnDate) lit = Loans.erase(lit);
-            else ++lit;
+        Guard g(*this);
+        int32_t ri = FindReaderLocked(id);
+        if (ri < 0) return false;
+        ReaderAt(ri) = ReaderAt(--H().nReaders);
+        // drop the reader's open loans; loan indexes shift, so re-point books
+        uint32_t w = 0;
+        for (uint32_t i = 0; i < H().nLoans; ++i) {
+            SLoan &l = LoanAt(i);
+            if (l.readerId == id && !l.returnDate[0]) continue;
+            if (w != i) LoanAt(w) = l;
+            ++w;
+        }
+        H().nLoans = w;
+        for (uint32_t i = 0; i < H().nBooks; ++i) BookAt(i).openLoan = -1;
+        for (uint32_t i = 0; i < H().nLoans; ++i) {
+            if (LoanAt(i).returnDate[0]) continue;
+            if (int32_t bi = FindBookLocked(LoanAt(i).isbn); bi >= 0) BookAt(bi).openLoan = i;
         }
-        Readers.erase(it);
         return true;
     }
 
     bool IssueLoan(const std::string &isbn, int readerId) {
-        Book* b = FindBook(isbn);
-        if (!b) return false;
-        if (!b->IsAvailable) return false;
-        if (!FindReader(readerId)) return false;
-        Loan ln;
-        ln.BookISBN = isbn;
-        ln.ReaderId = readerId;
-        ln.LoanDate = now_iso();
-        ln.ReturnDate = std::nullopt;
-        Loans.push_back(ln);
-        b->MarkAsLoaned();
+        Guard g(*this);
+        int32_t bi = FindBookLocked(isbn);
+        if (bi < 0 || BookAt(bi).openLoan >= 0 || FindReaderLocked(readerId) < 0 || H().nLoans >= H().capLoans) return false;
+        Loan l{isbn, readerId, now_iso(), std::nullopt};
+        ToLoan(l, LoanAt(H().nLoans));
+        BookAt(bi).openLoan = H().nLoans++;
         return true;
     }
 
     bool ReturnBook(const std::string &isbn, int readerId) {
-        auto it = std::find_if(Loans.begin(), Loans.end(), [&](const Loan &l){ return l.BookISBN == isbn && l.ReaderId == readerId && !l.ReturnDate; });
-        if (it == Loans.end()) return false;
-        it->ReturnDate = now_iso();
-        Book* b = FindBook(isbn);
-        if (b) b->MarkAsAvailable();
+        Guard g(*this);
+        int32_t bi = FindBookLocked(isbn);
+        if (bi < 0 || BookAt(bi).openLoan < 0) return false;
+        SLoan &l = LoanAt(BookAt(bi).openLoan);
+        if (l.readerId != readerId) return false;
+        Copy(l.returnDate, now_iso());
+        BookAt(bi).openLoan = -1;
         return true;
     }
 
     std::vector<Book> SearchBooks(const std::string &term) const {
-        if (term.empty()) return Books;
-        std::string q = Lower(term);
+        std::string q = FoldCase(term);
+        auto lower = [](const char *s){ return FoldCase(s); };
         std::vector<Book> res;
-        for (auto &b : Books) {
-            if (Lower(b.Title).find(q) != std::string::npos || Lower(b.Author).find(q) != std::string::npos)
-                res.push_back(b);
+        Guard g(*this);
+        for (uint32_t i = 0; i < H().nBooks; ++i) {
+            const SBook &b = BookAt(i);
+            if (q.empty() || lower(b.title).find(q) != std::string::npos || lower(b.author).find(q) != std::string::npos) res.push_back(ToBook(b));
         }
         return res;
     }
 
-    void Save(const std::string &booksFile, const std::string &readersFile, const std::string &loansFile) const {
-        json jb = json::array();
-        for (auto &b : Books) jb.push_back(b.to_json());
-        std::ofstream(booksFile) << jb.dump(4);
-
-        json jr = json::array();
-        for (auto &r : Readers) jr.push_back(r.to_json());
-        std::ofstream(readersFile) << jr.dump(4);
-
-        json jl = json::array();
-        for (auto &l : Loans) jl.push_back(l.to_json());
-        std::ofstream(loansFile) << jl.dump(4);
-    }
-
-    void Load(const std::string &booksFile, const std::string &readersFile, const std::string &loansFile) {
-        Books.clear(); Readers.clear(); Loans.clear();
-        try {
-            std::ifstream f1(booksFile);
-            if (f1) {
-                json jb; f1 >> jb;
-                for (auto &x : jb) Books.push_back(Book::from_json(x));
-            }
-            std::ifstream f2(readersFile);
-            if (f2) {
-                json jr; f2 >> jr;
-                for (auto &x : jr) Readers.push_back(Reader::from_json(x));
-            }
-            std::ifstream f3(loansFile);
-            if (f3) {
-                json jl; f3 >> jl;
-                for (auto &x : jl) Loans.push_back(Loan::from_json(x));
-            }
-        } catch (...) {
-            // ignore errors, start fresh
-        }
-    }
-
     std::vector<Book> AvailableBooks() const {
         std::vector<Book> res;
-        for (auto &b : Books) if (b.IsAvailable) res.push_back(b);
+        Guard g(*this);
+        for (uint32_t i = 0; i < H().nBooks; ++i) if (BookAt(i).openLoan < 0) res.push_back(ToBook(BookAt(i)));
         return res;
     }
+
     std::vector<Loan> ActiveLoans() const {
         std::vector<Loan> res;
-        for (auto &l : Loans) if (!l.ReturnDate) res.push_back(l);
+        Guard g(*this);
+        for (uint32_t i = 0; i < H().nLoans; ++i) if (!LoanAt(i).returnDate[0]) res.push_back(FromLoan(LoanAt(i)));
         return res;
     }
 
+    size_t BookCount() const { Guard g(*this); return H().nBooks; }
+    size_t ReaderCount() const { Guard g(*this); return H().nReaders; }
+
 private:
-    static std::string Lower(std::string s) {
-        std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c){ return std::tolower(c); });
-        return s;
+    static constexpr uint32_t Magic = 0x4c49424f; // "LIBO"; bumped when a record layout changes
+    static constexpr uint32_t Empty = 0xffffffff, Tomb = 0xfffffffe;
+
+    struct SBook { char title[128]; char author[96]; char isbn[32]; char added[24]; int32_t openLoan; };
+    struct SReader { int32_t id; char name[96]; char email[96]; char registered[24]; };
+    struct SLoan { char isbn[32]; int32_t readerId; char loanDate[24]; char returnDate[24]; };
+    struct Header {
+        std::atomic<uint32_t> ready;
+        pthread_mutex_t mu;
+        uint32_t capBooks, capReaders, capLoans, indexSize;
+        uint32_t nBooks, nReaders, nLoans;
+        uint64_t offBooks, offReaders, offLoans, offIndex; // offsets from the region base
+    };
+    struct Offsets { uint64_t books, readers, loans, index, total; uint32_t indexSize; };
+
+    char *base = nullptr;
+    size_t size = 0;
+
+    // locks the region; a holder that died is recovered via the robust mutex
+    struct Guard {
+        const SharedLibrary &lib;
+        explicit Guard(const SharedLibrary &l) : lib(l) {
+            if (pthread_mutex_lock(&lib.H().mu) == EOWNERDEAD) pthread_mutex_consistent(&lib.H().mu);
+        }
+        ~Guard() { pthread_mutex_unlock(&lib.H().mu); }
+    };
+
+    static Offsets Layout(const Capacity &cap) {
+        Offsets o;
+        o.indexSize = 1;
+        while (o.indexSize < cap.Books * 2) o.indexSize <<= 1;
+        auto align = [](uint64_t x){ return (x + 63) & ~uint64_t(63); };
+        o.books = align(sizeof(Header));
+        o.readers = align(o.books + uint64_t(cap.Books) * sizeof(SBook));
+        o.loans = align(o.readers + uint64_t(cap.Readers) * sizeof(SReader));
+        o.index = align(o.loans + uint64_t(cap.Loans) * sizeof(SLoan));
+        o.total = o.index + uint64_t(o.indexSize) * sizeof(uint32_t);
+        return o;
     }
 
-    Book* FindBook(const std::string &isbn) {
-        auto it = std::find_if(Books.begin(), Books.end(), [&](const Book &b){ return b.ISBN == isbn; });
-        return it == Books.end() ? nullptr : &(*it);
+    void Init(const Capacity &cap) {
+        Offsets o = Layout(cap);
+        Header &h = *new (base) Header;
+        pthread_mutexattr_t a;
+        pthread_mutexattr_init(&a);
+        pthread_mutexattr_setpshared(&a, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&a, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&h.mu, &a);
+        pthread_mutexattr_destroy(&a);
+        h.capBooks = cap.Books; h.capReaders = cap.Readers; h.capLoans = cap.Loans; h.indexSize = o.indexSize;
+        h.nBooks = h.nReaders = h.nLoans = 0;
+        h.offBooks = o.books; h.offReaders = o.readers; h.offLoans = o.loans; h.offIndex = o.index;
+        std::fill(Index(), Index() + h.indexSize, Empty);
+        h.ready.store(Magic);
     }
-    const Book* FindBook(const std::string &isbn) const {
-        auto it = std::find_if(Books.begin(), Books.end(), [&](const Book &b){ return b.ISBN == isbn; });
-        return it == Books.end() ? nullptr : &(*it);
+
+    Header &H() const { return *reinterpret_cast<Header *>(base); }
+    SBook &BookAt(uint32_t i) const { return reinterpret_cast<SBook *>(base + H().offBooks)[i]; }
+    SReader &ReaderAt(uint32_t i) const { return reinterpret_cast<SReader *>(base + H().offReaders)[i]; }
+    SLoan &LoanAt(uint32_t i) const { return reinterpret_cast<SLoan *>(base + H().offLoans)[i]; }
+    uint32_t *Index() const { return reinterpret_cast<uint32_t *>(base + H().offIndex); }
+
+    // Longest prefix of at most n bytes that ends on a code-point boundary,
+    // so cut text stays valid UTF-8 (Save would throw on a split character).
+    static std::string Clip(const std::string &s, size_t n) {
+        if (s.size() <= n) return s;
+        while (n > 0 && (static_cast<unsigned char>(s[n]) & 0xC0) == 0x80) --n;
+        return s.substr(0, n);
     }
-    Reader* FindReader(int id) {
-        auto it = std::find_if(Readers.begin(), Readers.end(), [&](const Reader &r){ return r.Id == id; });
-        return it == Readers.end() ? nullptr : &(*it);
+    template <size_t N> static void Copy(char (&dst)[N], const std::string &src) {
+        std::string v = Clip(src, N - 1);
+        std::memcpy(dst, v.data(), v.size());
+        dst[v.size()] = 0;
     }
-    const Reader* FindReader(int id) const {
-        auto it = std::find_if(Readers.begin(), Readers.end(), [&](const Reader &r){ return r.Id == id; });
-        return it == Readers.end() ? nullptr : &(*it);
+
+    static Book ToBook(const SBook &s) {
+        Book b{s.title, s.author, s.isbn, s.openLoan < 0, s.added};
+        return b;
+    }
+    static void ToLoan(const Loan &l, SLoan &s) {
+        Copy(s.isbn, l.BookISBN);
+        s.readerId = l.ReaderId;
+        Copy(s.loanDate, l.LoanDate);
+        Copy(s.returnDate, l.ReturnDate ? *l.ReturnDate : "");
+    }
+    static Loan FromLoan(const SLoan &s) {
+        Loan l{s.isbn, s.readerId, s.loanDate, std::nullopt};
+        if (s.returnDate[0]) l.ReturnDate = std::string(s.returnDate);
+        return l;
+    }
+
+    // open addressing over ISBNs; returns the slot holding `isbn` or, if
+    // absent, the first free (empty or tombstone) slot on its probe path
+    uint32_t &IndexSlot(const std::string &isbn) const {
+        uint32_t mask = H().indexSize - 1;
+        uint32_t *free = nullptr;
+        for (uint32_t i = hash64(isbn) & mask;; i = (i + 1) & mask) {
+            uint32_t &s = Index()[i];
+            if (s == Empty) return free ? *free : s;
+            if (s == Tomb) { if (!free) free = &s; continue; }
+            if (isbn == BookAt(s).isbn) return s;
+        }
+    }
+    int32_t FindBookLocked(const std::string &isbn) const {
+        uint32_t s = IndexSlot(isbn);
+        return s == Empty || s == Tomb ? -1 : (int32_t)s;
+    }
+    int32_t FindReaderLocked(int id) const {
+        for (uint32_t i = 0; i < H().nReaders; ++i) if (ReaderAt(i).id == id) return i;
+        return -1;
+    }
+
+    bool AddBookLocked(const Book &b) {
+        if (H().nBooks >= H().capBooks || b.ISBN.size() >= sizeof(SBook::isbn) ||
+            b.Title.size() >= sizeof(SBook::title) || b.Author.size() >= sizeof(SBook::author)) return false;
+        uint32_t &slot = IndexSlot(b.ISBN);
+        if (slot != Empty && slot != Tomb) return false;
+        SBook &s = BookAt(H().nBooks);
+        Copy(s.title, b.Title);
+        Copy(s.author, b.Author);
+        Copy(s.isbn, b.ISBN);
+        Copy(s.added, b.Added.empty() ? now_iso() : b.Added);
+        s.openLoan = -1;
+        slot = H().nBooks++;
+        return true;
+    }
+    bool AddReaderLocked(const Reader &r) {
+        if (H().nReaders >= H().capReaders || FindReaderLocked(r.Id) >= 0 ||
+            r.Name.size() >= sizeof(SReader::name) || r.Email.size() >= sizeof(SReader::email)) return false;
+        SReader &s = ReaderAt(H().nReaders++);
+        s.id = r.Id;
+        Copy(s.name, r.Name);
+        Copy(s.email, r.Email);
+        Copy(s.registered, r.Registered.empty() ? now_iso() : r.Registered);
+        return true;
+    }
+};
+
+void printMenu();
+
+// Desk loop over a SharedLibrary; other desk processes see every change at once.
+static int RunSharedDesk(const std::string &path, const std::string &booksFile, const std::string &readersFile, const std::string &loansFile) {
+    SharedLibrary lib;
+    bool created = false;
+    if (!lib.Open(path, created)) { std::cout << "Cannot map " << path << ".\n"; return 1; }
+    if (created) {
+        LibraryManager seed;
+        if (!seed.Load(booksFile, readersFile, loansFile)) { std::cout << "Cannot parse the library files; not seeding " << path << ".\n"; return 1; }
+        lib.Import(seed);
+    }
+    std::cout << "Shared mode on " << path << ": " << lib.BookCount() << " books, " << lib.ReaderCount() << " readers.\n";
+    while (true) {
+        printMenu();
+        std::string cmd;
+        if (!std::getline(std::cin, cmd)) break;
+        if (cmd == "1") {
+            Book b;
+            std::cout << "Title: "; std::getline(std::cin, b.Title);
+            std::cout << "Author: "; std::getline(std::cin, b.Author);
+            std::cout << "ISBN: "; std::getline(std::cin, b.ISBN);
+            if (lib.AddBook(b)) std::cout << "Book added.\n"; else std::cout << "Book exists or a field is too long.\n";
+        } else if (cmd == "2") {
+            std::cout << "ISBN to remove: "; std::string isbn; std::getline(std::cin, isbn);
+            if (lib.RemoveBook(isbn)) std::cout << "Removed.\n"; else std::cout << "Remove failed (not found or loaned).\n";
+        } else if (cmd == "3") {
+            Reader r;
+            r.Id = lib.NextReaderId();
+            std::cout << "Name: "; std::getline(std::cin, r.Name);
+            std::cout << "Email: "; std::getline(std::cin, r.Email);
+            if (lib.AddReader(r)) std::cout << "Reader added with Id=" << r.Id << "\n";
+            else std::cout << "Name or email too long.\n";
+        } else if (cmd == "4") {
+            std::cout << "Reader id to remove: "; std::string sid; std::getline(std::cin, sid);
+            if (lib.RemoveReader(std::stoi(sid))) std::cout << "Removed.\n"; else std::cout << "Not found.\n";
+        } else if (cmd == "5") {
+            std::cout << "ReaderId: "; std::string s; std::getline(std::cin, s); int rid = std::stoi(s);
+            std::cout << "ISBN: "; std::string isbn; std::getline(std::cin, isbn);
+            if (lib.IssueLoan(isbn, rid)) std::cout << "Issued.\n"; else std::cout << "Issue failed.\n";
+        } else if (cmd == "6") {
+            std::cout << "ReaderId: "; std::string s; std::getline(std::cin, s); int rid = std::stoi(s);
+            std::cout << "ISBN: "; std::string isbn; std::getline(std::cin, isbn);
+            if (lib.ReturnBook(isbn, rid)) std::cout << "Returned.\n"; else std::cout << "Return failed.\n";
+        } else if (cmd == "7") {
+            std::cout << "Search term: "; std::string q; std::getline(std::cin, q);
+            for (auto &b : lib.SearchBooks(q))
+                std::cout << b.Title << " — " << b.Author << " — " << b.ISBN << " — " << (b.IsAvailable ? "Available" : "Loaned") << "\n";
+        } else if (cmd == "8") {
+            std::cout << "Available books:\n";
+            for (auto &b : lib.AvailableBooks()) std::cout << b.Title << " — " << b.Author << " — " << b.ISBN << "\n";
+            std::cout << "Active loans:\n";
+            for (auto &l : lib.ActiveLoans()) std::cout << "ISBN: " << l.BookISBN << " ReaderId: " << l.ReaderId << " since " << l.LoanDate << "\n";
+        } else if (cmd == "9") {
+            if (!lib.Save(booksFile, readersFile, loansFile)) { std::cout << "Save failed; nothing was overwritten.\n"; continue; }
+            std::cout << "Saved. Exiting.\n";
+            break;
+        } else if (cmd == "0") {
+            std::cout << "Exit; the shared data stays live for other desks.\n";
+            break;
+        } else {
+            std::cout << "Not available in shared mode.\n";
+        }
     }
+    return 0;
+}
+#endif
+
+static std::vector<int> ParsePorts(const std::string &list) {
+    std::vector<int> ports;
+    std::stringstream ss(list);
+    std::string p;
+    while (std::getline(ss, p, ',')) ports.push_back(std::stoi(p));
+    return ports;
+}
+
+struct KioskMergeReport {
+    size_t Applied = 0;
+    std::vector<std::string> Conflicts;
 };
 
+// Reconciles offline kiosk journals with the central state in one batch. All
+// issues and returns are ordered by their own timestamp (ties: kiosk, then
+// Seq), so the outcome does not depend on which kiosk reconnects first, and
+// are applied in a single transaction. A kiosk issue and its return at the
+// same kiosk form one loan, checked against the central history for that
+// period (RecordLoan). Operations that no longer fit, e.g. a book issued at
+// two kiosks or lent by central meanwhile, are reported instead of applied.
+static KioskMergeReport MergeKioskJournals(LibraryManager &central, const std::vector<std::vector<ChangeEvent>> &journals) {
+    struct Op { std::string Date; size_t Kiosk; uint64_t Seq; const ChangeEvent *E; std::optional<std::string> Until; };
+    std::vector<Op> ops;
+    std::deque<ChangeEvent> parts; // steps of Tx events, at their transaction's Seq
+    for (size_t k = 0; k < journals.size(); ++k) {
+        std::map<std::pair<std::string, int>, size_t> issued; // this kiosk's open issues -> ops index
+        for (auto &je : journals[k]) {
+            std::vector<const ChangeEvent *> steps{&je};
+            if (je.Op == "Tx") {
+                steps.clear();
+                for (auto &op : je.Data.value("Ops", json::array())) {
+                    parts.push_back(ChangeEvent{je.Seq, op.value("Op", ""), je.Time, op["Data"]});
+                    steps.push_back(&parts.back());
+                }
+            }
+            for (auto *e : steps) {
+                auto key = std::make_pair(e->Data.value("BookISBN", ""), e->Data.value("ReaderId", 0));
+                if (e->Op == "IssueLoan") {
+                    issued[key] = ops.size();
+                    ops.push_back({e->Data.value("LoanDate", ""), k, e->Seq, e, std::nullopt});
+                } else if (e->Op == "ReturnBook") {
+                    auto it = issued.find(key);
+                    if (it != issued.end()) { ops[it->second].Until = e->Data.value("ReturnDate", ""); issued.erase(it); }
+                    else ops.push_back({e->Data.value("ReturnDate", ""), k, e->Seq, e, std::nullopt});
+                }
+            }
+        }
+    }
+    std::sort(ops.begin(), ops.end(), [](const Op &a, const Op &b){ return std::tie(a.Date, a.Kiosk, a.Seq) < std::tie(b.Date, b.Kiosk, b.Seq); });
+
+    KioskMergeReport rep;
+    LibraryManager::Transaction tx(central);
+    for (auto &op : ops) {
+        std::string isbn = op.E->Data.value("BookISBN", "");
+        int rid = op.E->Data.value("ReaderId", 0);
+        std::string where = " (kiosk " + std::to_string(op.Kiosk + 1) + ", reader " + std::to_string(rid) + ", " + op.Date + ")";
+        if (op.E->Op == "IssueLoan") {
+            if (op.Until ? tx.RecordLoan(isbn, rid, op.Date, *op.Until) : tx.IssueLoan(isbn, rid, op.Date)) {
+                rep.Applied += op.Until ? 2 : 1;
+                continue;
+            }
+            bool knownReader = std::any_of(central.Readers.begin(), central.Readers.end(), [&](const Reader &r){ return r.Id == rid; });
+            if (!central.GetBook(isbn)) rep.Conflicts.push_back("Issue of unknown book " + isbn + where);
+            else if (!knownReader) rep.Conflicts.push_back("Issue to unknown reader " + std::to_string(rid) + where);
+            else rep.Conflicts.push_back("Double issue of " + isbn + where);
+        } else {
+            if (tx.ReturnBook(isbn, rid, op.Date)) { ++rep.Applied; continue; }
+            rep.Conflicts.push_back("Return of " + isbn + " without a matching open loan" + where);
+        }
+    }
+    tx.Commit();
+    return rep;
+}
+
 void printMenu() {
     std::cout << "\n--- Library Menu ---\n";
-    std::cout << "1. Add book\n2. Remove book\n3. Add reader\n4. Remove reader\n5. Issue book\n6. Return book\n7. Search books\n8. Reports\n9. Save & Exit\n0. Exit without save\nChoice: ";
+    std::cout << "1. Add book\n2. Remove book\n3. Add reader\n4. Remove reader\n5. Issue book\n6. Return book\n7. Search books\n8. Reports\n10. Purge inactive readers & anonymize history\n11. Transfer loan\n12. Book history at date\n13. Find author by sound\n14. Browse alphabetically\n9. Save & Exit\n0. Exit without save\nChoice: ";
 }
 
-int main() {
+int main(int argc, char **argv) {
+    // worker pool for the parallel features: LIBRARY_THREADS=<n>, LIBRARY_PIN_THREADS=1
+    if (const char *t = std::getenv("LIBRARY_THREADS")) DefaultPoolOptions().Threads = std::stoul(t);
+    if (const char *p = std::getenv("LIBRARY_PIN_THREADS")) DefaultPoolOptions().PinToCores = std::string(p) == "1";
+
     LibraryManager mgr;
     const std::string booksFile = "books.json";
     const std::string readersFile = "readers.json";
     const std::string loansFile = "loans.json";
+    const std::string changeLog = "changes.log";
+
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+    // --async-bench <n> [window]: concurrent issues, returns and searches through
+    // AsyncLibrary (journal in async-bench.log; the library files are not touched)
+    if (argc > 2 && std::string(argv[1]) == "--async-bench")
+        return RunAsyncBench(std::stoul(argv[2]), "async-bench.log", argc > 3 ? std::max<size_t>(1, std::stoul(argv[3])) : 1000);
+#endif
+
+#ifndef _WIN32
+    // --raft-node <id> <port,port,...>: cluster member; state lives in raft-<id>.log
+    if (argc > 3 && std::string(argv[1]) == "--raft-node") {
+        std::atomic<bool> stop{false};
+        RaftNode node(std::stoi(argv[2]), ParsePorts(argv[3]));
+        if (!node.Run(stop)) { std::cout << "Cannot bind port.\n"; return 1; }
+        return 0;
+    }
+    // --raft-bench <port,port,...> <n>: adds n books and issues each of them through the cluster
+    if (argc > 3 && std::string(argv[1]) == "--raft-bench") {
+        RaftClient client(ParsePorts(argv[2]));
+        int n = std::stoi(argv[3]);
+        std::string tag = std::to_string(std::time(nullptr));
+        std::vector<std::pair<std::string, json>> books, loans;
+        for (int i = 0; i < n; ++i) {
+            std::string isbn = tag + "-" + std::to_string(i);
+            books.push_back({"AddBook", Book{"Bench " + std::to_string(i), "Bench", isbn}.to_json()});
+            loans.push_back({"IssueLoan", json{{"BookISBN", isbn}, {"ReaderId", 1}}});
+        }
+        client.Submit({{"AddReader", Reader{1, "Bench", ""}.to_json()}});
+        client.Submit(books);
+        auto t0 = std::chrono::steady_clock::now();
+        size_t ok = client.Submit(loans);
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        std::cout << "Issued " << ok << "/" << n << " loans in " << secs << " s (" << (size_t)(n / secs) << " loans/s)\n";
+        return 0;
+    }
+    // --shm <file>: desk on a dataset shared by all desk processes on this machine
+    if (argc > 2 && std::string(argv[1]) == "--shm") return RunSharedDesk(argv[2], booksFile, readersFile, loansFile);
+    // --shard <port>: shard worker, data in shard-<port>-*.json
+    if (argc > 2 && std::string(argv[1]) == "--shard") {
+        std::atomic<bool> stop{false};
+        ShardWorker worker(std::stoi(argv[2]));
+        if (!worker.Run(stop)) { std::cout << "Cannot load shard-" << argv[2] << "-*.json or bind port.\n"; return 1; }
+        return 0;
+    }
+    // --shard-bench <port,port,...> <new port> <n>: loads n books through the
+    // router, then adds a shard and reports how many books had to move
+    if (argc > 4 && std::string(argv[1]) == "--shard-bench") {
+        ShardRouter router(ParsePorts(argv[2]));
+        int n = std::stoi(argv[4]);
+        router.AddReader(Reader{1, "Bench", ""});
+        for (int i = 0; i < n; ++i) router.AddBook(Book{"Bench " + std::to_string(i), "Bench", "isbn-" + std::to_string(i)});
+        size_t issued = 0;
+        for (int i = 0; i < n; i += 2) issued += router.IssueLoan("isbn-" + std::to_string(i), 1);
+        std::cout << "Books: " << router.CountBooks() << ", issued " << issued << ", search hits: " << router.SearchBooks("bench 1", n).size() << "\n";
+        size_t moved = router.AddShard(std::stoi(argv[3]));
+        size_t found = 0, loaned = 0;
+        for (int i = 0; i < n; ++i) {
+            auto b = router.FindBook("isbn-" + std::to_string(i));
+            found += b.has_value();
+            loaned += b && !b->IsAvailable;
+        }
+        std::cout << "Added shard: moved " << moved << " of " << n << " books; found " << found << ", loaned " << loaned << "\n";
+        router.SaveAll();
+        return 0;
+    }
+#endif
+
+    // --federate <dir> <dir> ...: network-wide search over several branch directories
+    if (argc > 2 && std::string(argv[1]) == "--federate") {
+        std::vector<std::string> dirs(argv + 2, argv + argc);
+        std::vector<LibraryManager> branchMgrs(dirs.size());
+        Federation fed;
+        for (size_t i = 0; i < dirs.size(); ++i) {
+            if (!branchMgrs[i].Load(dirs[i] + "/" + booksFile, dirs[i] + "/" + readersFile, dirs[i] + "/" + loansFile)) {
+                std::cout << "Cannot parse the library files in " << dirs[i] << ".\n";
+                return 1;
+            }
+            fed.AddBranch(dirs[i], &branchMgrs[i]);
+        }
+        while (true) {
+            std::cout << "Search term (empty to exit): "; std::string q;
+            if (!std::getline(std::cin, q) || q.empty()) break;
+            std::vector<std::string> timedOut;
+            for (auto &h : fed.SearchBooks(q, std::chrono::milliseconds(500), &timedOut)) {
+                std::cout << h.Record.Title << " — " << h.Record.Author << " — " << h.Record.ISBN << " — ";
+                if (h.AvailableAt.empty()) std::cout << "Loaned everywhere\n";
+                else {
+                    std::cout << "Available at:";
+                    for (auto &b : h.AvailableAt) std::cout << " " << b;
+                    std::cout << "\n";
+                }
+            }
+            for (auto &b : timedOut) std::cout << "(no answer from " << b << ")\n";
+        }
+        return 0;
+    }
+
+    // --merkle-sync <src dir> <dst dir>: brings dst's files in line with src, copying only differing buckets
+    if (argc > 3 && std::string(argv[1]) == "--merkle-sync") {
+        std::string src = argv[2], dst = argv[3];
+        LibraryManager from, to;
+        if (!from.Load(src + "/" + booksFile, src + "/" + readersFile, src + "/" + loansFile) ||
+            !to.Load(dst + "/" + booksFile, dst + "/" + readersFile, dst + "/" + loansFile)) {
+            std::cout << "Cannot parse the library files in " << src << " or " << dst << ".\n";
+            return 1;
+        }
+        auto st = SyncFrom(to, from);
+        if (!to.Save(dst + "/" + booksFile, dst + "/" + readersFile, dst + "/" + loansFile)) { std::cout << "Cannot write " << dst << ".\n"; return 1; }
+        std::cout << "Compared " << st.HashesExchanged << " hashes, " << st.BucketsDiffering << " buckets differ, transferred "
+                  << st.BooksTransferred << " books.\n";
+        return 0;
+    }
+
+    // --merge-kiosk <dir> ...: folds offline kiosk journals into the central files
+    // and refreshes each kiosk's snapshot
+    if (argc > 2 && std::string(argv[1]) == "--merge-kiosk") {
+        if (!mgr.Load(booksFile, readersFile, loansFile)) { std::cout << "Cannot parse the library files; nothing merged.\n"; return 1; }
+        mgr.OpenChangeLog(changeLog);
+        mgr.Checkpoint();
+        std::vector<std::string> dirs(argv + 2, argv + argc);
+        std::vector<std::vector<ChangeEvent>> journals;
+        for (auto &d : dirs) journals.push_back(EventsSinceCheckpoint(d + "/" + changeLog));
+        auto res = MergeKioskJournals(mgr, journals);
+        if (!mgr.Save(booksFile, readersFile, loansFile)) { std::cout << "Cannot write the library files; kiosk journals kept.\n"; return 1; }
+        mgr.Checkpoint();
+        for (auto &d : dirs) {
+            // its operations are merged either way, so the journal is reset regardless
+            if (!mgr.Save(d + "/" + booksFile, d + "/" + readersFile, d + "/" + loansFile))
+                std::cout << "Cannot refresh the snapshot in " << d << "; copy the library files there by hand.\n";
+            LibraryManager kiosk;
+            kiosk.OpenChangeLog(d + "/" + changeLog);
+            kiosk.Checkpoint();
+        }
+        std::cout << "Merged " << res.Applied << " kiosk operations, " << res.Conflicts.size() << " conflicts.\n";
+        for (auto &c : res.Conflicts) std::cout << "  " << c << "\n";
+        return 0;
+    }
+
+    // --kiosk <dir>: offline desk on the snapshot in <dir>; issues and returns are
+    // journaled to <dir>/changes.log until the next --merge-kiosk
+    std::string kioskDir;
+    if (argc > 2 && std::string(argv[1]) == "--kiosk") {
+        kioskDir = argv[2];
+        JournalFollower local(mgr, kioskDir + "/" + booksFile, kioskDir + "/" + readersFile, kioskDir + "/" + loansFile, kioskDir + "/" + changeLog);
+        if (!local.Start()) { std::cout << "Cannot parse the snapshot in " << kioskDir << ".\n"; return 1; }
+        mgr.OpenChangeLog(kioskDir + "/" + changeLog);
+        std::cout << "Kiosk mode: offline, journaling to " << kioskDir << "/" << changeLog << ".\n";
+    }
+
+    // --follow: read-only replica of a primary running in the same directory
+    std::optional<JournalFollower> follower;
+    if (argc > 1 && std::string(argv[1]) == "--follow") {
+        follower.emplace(mgr, booksFile, readersFile, loansFile, changeLog);
+        if (!follower->Start()) { std::cout << "Cannot parse the library files.\n"; return 1; }
+        std::cout << "Follower mode: read-only, replaying " << changeLog << ".\n";
+    }
 
-    mgr.Load(booksFile, readersFile, loansFile);
+    if (!follower && kioskDir.empty()) {
+        if (!mgr.Load(booksFile, readersFile, loansFile)) {
+            std::cout << "Cannot parse " << booksFile << ", " << readersFile << " or " << loansFile << "; not starting.\n";
+            return 1;
+        }
+        mgr.OpenChangeLog(changeLog);
+        mgr.Checkpoint();
+    }
+    auto rep = follower || !kioskDir.empty() ? IntegrityReport{} : mgr.CheckIntegrity(true);
+    if (!rep.Ok()) {
+        std::cout << "Integrity repair: dropped " << rep.DanglingBookLoans << " loans of missing books, "
+                  << rep.DanglingReaderLoans << " loans of missing readers; fixed availability of "
+                  << rep.AvailabilityFixes << " books; kept only the latest open loan of " << rep.DuplicateOpenLoans << " books.\n";
+    }
     std::cout << "Library system started. Loaded " << mgr.Books.size() << " books, " << mgr.Readers.size() << " readers.\n";
 
     while (true) {
         printMenu();
         std::string cmd; std::getline(std::cin, cmd);
+        if (follower) {
+            follower->CatchUp();
+            if (cmd != "7" && cmd != "8" && cmd != "12" && cmd != "13" && cmd != "14" && cmd != "0") {
+                std::cout << "Read-only replica: only search, reports and history are available.\n";
+                continue;
+            }
+        }
+        if (!kioskDir.empty()) {
+            if (cmd == "9") { std::cout << "Kiosk journal is on disk. Exiting.\n"; break; }
+            if (cmd != "5" && cmd != "6" && cmd != "7" && cmd != "8" && cmd != "12" && cmd != "13" && cmd != "14" && cmd != "0") {
+                std::cout << "Kiosk mode: only issue, return, search, reports and history are available.\n";
+                continue;
+            }
+        }
         if (cmd == "1") {
             Book b;
             std::cout << "Title: "; std::getline(std::cin, b.Title);
@@ -276,17 +4082,72 @@ int main() {
             if (mgr.ReturnBook(isbn, rid)) std::cout << "Returned.\n"; else std::cout << "Return failed.\n";
         } else if (cmd == "7") {
             std::cout << "Search term: "; std::string q; std::getline(std::cin, q);
-            auto res = mgr.SearchBooks(q);
-            for (auto &b : res) {
+            // best matches first, 50 per page; a partial word finds nothing ranked,
+            // so fall back to the substring scan
+            auto print = [](const Book &b) {
                 std::cout << b.Title << " — " << b.Author << " — " << b.ISBN << " — " << (b.IsAvailable ? "Available" : "Loaned") << "\n";
+            };
+            auto hits = mgr.SearchRanked(q, 50);
+            if (hits.empty()) {
+                for (auto &b : mgr.SearchBooks(q)) print(b);
+                continue;
+            }
+            auto fc = mgr.SearchFacets(q, 5);
+            std::cout << fc.Matches << " matches: " << fc.Available << " available, " << fc.Loaned << " loaned. Authors:";
+            for (auto &a : fc.Authors) std::cout << " " << a.first << " (" << a.second << ")";
+            std::cout << "\n";
+            size_t shown = 0;
+            while (true) {
+                for (size_t i = shown; i < hits.size(); ++i) print(hits[i].Record);
+                shown = hits.size();
+                std::cout << "Showing " << shown << " of " << fc.Matches << "\n";
+                if (shown >= fc.Matches) break;
+                std::cout << "More? (y/n): "; std::string more;
+                if (!std::getline(std::cin, more) || more != "y") break;
+                hits = mgr.SearchRanked(q, shown + 50);
+                if (hits.size() <= shown) break;
             }
         } else if (cmd == "8") {
             std::cout << "Available books:\n";
             for (auto &b : mgr.AvailableBooks()) std::cout << b.Title << " — " << b.Author << " — " << b.ISBN << "\n";
             std::cout << "Active loans:\n";
             for (auto &l : mgr.ActiveLoans()) std::cout << "ISBN: " << l.BookISBN << " ReaderId: " << l.ReaderId << " since " << l.LoanDate << "\n";
+        } else if (cmd == "10") {
+            std::cout << "Retention period in years: "; std::string s; std::getline(std::cin, s); int years = std::stoi(s);
+            auto st = mgr.PurgeAndAnonymize(years);
+            std::cout << "Removed " << st.ReadersRemoved << " readers, anonymized " << st.LoansAnonymized << " loans.\n";
+        } else if (cmd == "11") {
+            std::cout << "ISBN: "; std::string isbn; std::getline(std::cin, isbn);
+            std::cout << "From ReaderId: "; std::string s; std::getline(std::cin, s); int from = std::stoi(s);
+            std::cout << "To ReaderId: "; std::getline(std::cin, s); int to = std::stoi(s);
+            if (mgr.TransferLoan(isbn, from, to)) std::cout << "Transferred.\n"; else std::cout << "Transfer failed.\n";
+        } else if (cmd == "12") {
+            std::cout << "ISBN: "; std::string isbn; std::getline(std::cin, isbn);
+            std::cout << "Date (YYYY-MM-DDTHH:MM:SSZ): "; std::string ts; std::getline(std::cin, ts);
+            if (auto holder = mgr.HolderAt(isbn, ts)) std::cout << "Loaned to ReaderId " << *holder << "\n";
+            else if (auto avail = mgr.WasAvailableAt(isbn, ts)) std::cout << (*avail ? "Available\n" : "Not in the catalogue yet\n");
+            else std::cout << "Unknown (no record of the book at that date)\n";
+        } else if (cmd == "13") {
+            std::cout << "Author: "; std::string name; std::getline(std::cin, name);
+            for (auto &b : mgr.SearchAuthorSounds(name)) {
+                std::cout << b.Title << " — " << b.Author << " — " << b.ISBN << " — " << (b.IsAvailable ? "Available" : "Loaned") << "\n";
+            }
+        } else if (cmd == "14") {
+            std::cout << "By (t)itle or (a)uthor: "; std::string by; std::getline(std::cin, by);
+            std::cout << "Start at: "; std::string from; std::getline(std::cin, from);
+            auto field = by == "a" ? TextIndex::Author : TextIndex::Title;
+            std::string cursor;
+            while (true) {
+                auto page = mgr.Browse(field, cursor, 20, from);
+                for (auto &b : page.Books) std::cout << b.Title << " — " << b.Author << " — " << b.ISBN << "\n";
+                if (page.Next.empty()) break;
+                std::cout << "More? (y/n): "; std::string more;
+                if (!std::getline(std::cin, more) || more != "y") break;
+                cursor = page.Next;
+            }
         } else if (cmd == "9") {
-            mgr.Save(booksFile, readersFile, loansFile);
+            if (!mgr.Save(booksFile, readersFile, loansFile)) { std::cout << "Save failed; nothing was overwritten.\n"; continue; }
+            mgr.Checkpoint();
             std::cout << "Saved. Exiting.\n";
             break;
         } else if (cmd == "0") {